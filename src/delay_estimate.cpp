@@ -0,0 +1,230 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <complex>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+
+#include <eigen3/Eigen/Dense>
+#include <eigen3/unsupported/Eigen/FFT>
+
+#include "model/drone_model.hpp"
+#include "utils/parser.hpp"
+#include "utils/json.hpp"
+
+using namespace std;
+
+using json = nlohmann::json;
+
+string default_config = "/home/jsv/CVUT/master-thesis/config/ident_real.json";
+
+typedef Simple_drone_model M;
+typedef Eigen::Matrix<double, -1, M::o_dim, Eigen::RowMajor> o_mat;
+typedef Eigen::Matrix<double, -1, M::u_dim, Eigen::RowMajor> u_mat;
+
+// input delay from the cross-correlation of the observed state derivatives ds(t + d)
+// with the input effect f(o(t), u(t), p_prior) of the state eq for all lags d at once,
+// one FFT per channel and trajectory, trajectories are processed in parallel,
+// confidence is the peak-to-sidelobe ratio of the correlation averaged over channels
+
+struct xcorr_sum
+{
+	Eigen::Matrix<double, -1, M::s_dim> r; // sum of a(t + d)*b(t) over trajectories, row d
+	M::s_vec a2 = M::s_vec::Zero(); // sums of squares for the normalization
+	M::s_vec b2 = M::s_vec::Zero();
+
+	mutex mtx;
+};
+
+void xcorr_worker(const vector<string> *files, atomic<int> *next, xcorr_sum *sum,
+	const M::p_vec p, const double dt, const int max_lag)
+{
+	Eigen::FFT<double> fft;
+	o_mat pos;
+	u_mat input;
+
+	vector<double> a, b, r;
+	vector<complex<double>> A, B;
+
+	Eigen::Matrix<double, -1, M::s_dim> r_local(max_lag + 1, M::s_dim);
+	M::s_vec a2, b2, ds;
+
+	for (int k = (*next)++; k < files->size(); k = (*next)++) {
+		auto data = Parser::parse_log((*files)[k], {"input", "pos"}, {1, 1});
+		Parser::fill_matrix<M::o_dim>(pos, data["pos"]);
+		Parser::fill_matrix<M::u_dim>(input, data["input"]);
+
+		int N = pos.rows() - 1;
+		if (N <= max_lag)
+			continue;
+
+		int L = 1;
+		while (L < N + max_lag)
+			L *= 2; // zero padding, no circular wrap of the lags
+
+		r_local.setZero();
+		a2.setZero();
+		b2.setZero();
+
+		for (int i = 0; i < M::s_dim; i++) {
+			a.assign(L, 0);
+			b.assign(L, 0);
+
+			for (int t = 0; t < N; t++) {
+				a[t] = (pos(t + 1, i) - pos(t, i))/dt;
+				if (i == M::a_idx)
+					a[t] = remainder(pos(t + 1, i) - pos(t, i), 2*M_PI)/dt; // angle wraps around
+
+				M::state_eq(ds.data(), pos.row(t).data(), input.row(t).data(), p.data());
+				b[t] = ds[i];
+			}
+
+			double a_mean = 0, b_mean = 0;
+			for (int t = 0; t < N; t++) {
+				a_mean += a[t]/N;
+				b_mean += b[t]/N;
+			}
+			for (int t = 0; t < N; t++) {
+				a[t] -= a_mean;
+				b[t] -= b_mean;
+				a2[i] += a[t]*a[t];
+				b2[i] += b[t]*b[t];
+			}
+
+			// r(d) = sum_t a(t + d)*b(t) = ifft(A*conj(B))
+			fft.fwd(A, a);
+			fft.fwd(B, b);
+			for (int j = 0; j < A.size(); j++)
+				A[j] *= conj(B[j]);
+			fft.inv(r, A);
+
+			for (int d = 0; d <= max_lag; d++)
+				r_local(d, i) = r[d];
+		}
+
+		unique_lock<mutex> lck(sum->mtx);
+		sum->r += r_local;
+		sum->a2 += a2;
+		sum->b2 += b2;
+	}
+}
+
+int main(int argc, char const *argv[])
+{
+	string config_file = default_config;
+	if (argc > 1)
+		config_file = string(argv[1]);
+
+	json config = get_json_config(config_file);
+
+	double dt = config["dt"];
+
+	M::p_vec p = (array_to_vector<M::p_dim>(M::p_lb) + array_to_vector<M::p_dim>(M::p_ub))/2;
+	if (!config["p_prior"].is_null()) {
+		p = array_to_vector(config["p_prior"]);
+	}
+
+	int max_lag = 100;
+	if (!config["delay_max_lag"].is_null()) {
+		max_lag = config["delay_max_lag"];
+	}
+
+	int n_threads = 0;
+	if (!config["delay_threads"].is_null()) {
+		n_threads = config["delay_threads"];
+	}
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+
+	int max_models = 1000;
+	if (!config["max_models"].is_null()) {
+		max_models = config["max_models"];
+	}
+
+	string log_dir(config["log_dir"]);
+	vector<string> log_files = list_files_in_dir(log_dir);
+	vector<string> files;
+	for (int i = 0; i < min((int)log_files.size(), max_models); i++)
+		files.push_back(log_dir + "/" + log_files[i]);
+
+	xcorr_sum sum;
+	sum.r.setZero(max_lag + 1, M::s_dim);
+
+	atomic<int> next = 0;
+	vector<thread> workers;
+	for (int i = 0; i < min(n_threads, (int)files.size()); i++)
+		workers.push_back(thread(xcorr_worker, &files, &next, &sum, p, dt, max_lag));
+
+	for (auto &w : workers)
+		w.join();
+
+	// normalized correlation per channel, channels without input effect are skipped
+	Eigen::VectorXd corr = Eigen::VectorXd::Zero(max_lag + 1);
+	int n_channels = 0;
+	for (int i = 0; i < M::s_dim; i++) {
+		double norm = sqrt(sum.a2[i]*sum.b2[i]);
+		if (norm <= 0)
+			continue;
+
+		Eigen::VectorXd c = sum.r.col(i)/norm;
+		int d_i;
+		c.maxCoeff(&d_i);
+		cout << "channel " << i << " delay " << d_i << ", corr " << c[d_i] << endl;
+
+		corr += c;
+		n_channels += 1;
+	}
+
+	if (n_channels == 0) {
+		cerr << "no input excitation in the logs" << endl;
+		return 1;
+	}
+	corr /= n_channels;
+
+	int d;
+	double peak = corr.maxCoeff(&d);
+
+	// sub-sample delay from a parabola through the peak
+	double d_sub = d;
+	if (d > 0 && d < max_lag) {
+		double den = corr[d - 1] - 2*corr[d] + corr[d + 1];
+		if (den < 0)
+			d_sub = d + 0.5*(corr[d - 1] - corr[d + 1])/den;
+	}
+
+	// peak-to-sidelobe ratio, lags near the peak are excluded
+	int excl = max(2, max_lag/20);
+	double s_mean = 0, s_sq = 0;
+	int n_side = 0;
+	for (int j = 0; j <= max_lag; j++) {
+		if (abs(j - d) <= excl)
+			continue;
+		s_mean += corr[j];
+		s_sq += corr[j]*corr[j];
+		n_side += 1;
+	}
+	double psr = NAN;
+	if (n_side > 1) {
+		s_mean /= n_side;
+		double s_sd = sqrt(max(s_sq/n_side - s_mean*s_mean, 1e-12));
+		psr = (peak - s_mean)/s_sd;
+	}
+
+	cout << fixed << setprecision(3);
+	cout << "delay est " << d << " (" << d_sub << " samples, " << d_sub*dt << " s), corr "
+		<< peak << ", psr " << psr << endl;
+
+	if (!config["delay_corr_file"].is_null()) {
+		string corr_file = config["delay_corr_file"];
+		ofstream corr_log(corr_file);
+		corr_log << "lag,corr\n" << setprecision(5);
+		for (int j = 0; j <= max_lag; j++)
+			corr_log << j << ',' << corr[j] << '\n';
+	}
+
+	return 0;
+}
@@ -28,6 +28,7 @@ public:
 	pos_t step(pos_t obs, bool valid);
 
 	bool all_zero(pos_t obs);
+	bool last_valid() { return this->hold == 0; } // last step accepted the observation
 };
 
 
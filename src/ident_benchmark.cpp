@@ -0,0 +1,127 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <ceres/ceres.h>
+
+#include "optim/model_ident.hpp"
+#include "utils/parser.hpp"
+#include "utils/json.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+using json = nlohmann::json;
+
+string default_config = "/home/jsv/CVUT/master-thesis/config/ident_real.json";
+
+// scaling of the identification with number of trajectories,
+// prints csv: solver, trajectories, samples, iterations, time [s], peak memory [MB],
+// memory is the peak of the build and solve above the resident size before it,
+// the loaded corpus is not counted
+
+void reset_peak_rss()
+{
+	ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5"; // resets the peak resident set size
+}
+
+long status_kb(const string &key)
+{
+	// VmHWM peak, VmRSS current resident set size
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line)) {
+		if (line.rfind(key + ":", 0) == 0)
+			return stol(line.substr(key.size() + 1));
+	}
+	return -1;
+}
+
+int main(int argc, char const *argv[])
+{
+	string config_file = default_config;
+	if (argc > 1)
+		config_file = string(argv[1]);
+
+	json config = get_json_config(config_file);
+
+	typedef Simple_drone_model M;
+
+	Model_ident<M> data_ident;
+	data_ident.set_config(config);
+
+	Model_ident<M>::o_mat pos;
+	Model_ident<M>::u_mat input;
+
+	int u_delay = config["u_delay"];
+
+	string log_dir(config["log_dir"]);
+	vector<string> log_files = list_files_in_dir(log_dir);
+
+	char buffer[256];
+	for (int i = 0; i < log_files.size(); i++) {
+		sprintf(buffer, "%s/%s", log_dir.c_str(), log_files[i].c_str());
+		auto data = Parser::parse_log(buffer,
+			{"input", "pos"},
+			{1, 1});
+
+		Parser::fill_matrix<M::o_dim>(pos, data["pos"]);
+		Parser::fill_matrix<M::u_dim>(input, data["input"]);
+
+		data_ident.add_trajectory(pos, input);
+	}
+
+	vector<int> n_trajectories = {10, 20, 50, 100, 200, 500};
+	if (!config["benchmark_trajectories"].is_null()) {
+		n_trajectories = config["benchmark_trajectories"].get<vector<int>>();
+	}
+
+	vector<string> solvers = {"sparse_cholesky", "sparse_schur", "iterative_schur"};
+	if (!config["benchmark_solvers"].is_null()) {
+		solvers = config["benchmark_solvers"].get<vector<string>>();
+	}
+
+	cerr << "loaded " << data_ident.pos_data.size() << " trajectories" << endl;
+	cout << "solver,trajectories,samples,iterations,time,memory" << endl;
+
+	for (string &solver : solvers) {
+		json solver_config = config;
+		solver_config["solver_linear_solver_type"] = solver;
+		solver_config["solver_stdout"] = false;
+
+		for (int n : n_trajectories) {
+			if (n > data_ident.pos_data.size())
+				break;
+
+			vector<int> idx(n);
+			int samples = 0;
+			for (int k = 0; k < n; k++) {
+				idx[k] = k;
+				samples += data_ident.pos_data[k]->rows();
+			}
+
+			Model_ident<M> model_ident;
+			model_ident.set_config(solver_config);
+			model_ident.share_trajectories(data_ident, idx);
+
+			ceres::Solver::Summary summary;
+			reset_peak_rss();
+			long base_rss = status_kb("VmRSS");
+			auto start = steady_clock::now();
+			model_ident.build_problem(u_delay);
+			model_ident.solve(&summary);
+			auto end = steady_clock::now();
+
+			double time = duration_cast<microseconds>(end - start).count()*1e-6;
+
+			cout << solver << "," << n << "," << samples << "," << summary.iterations.size() << ","
+				<< time << "," << (status_kb("VmHWM") - base_rss)/1024.0 << endl;
+		}
+	}
+
+	return 0;
+}
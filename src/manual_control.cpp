@@ -69,7 +69,7 @@ int main(int argc, char const *argv[])
 	MHE_handler<M> mhe;
 	json mhe_config = get_json_config(io_config["mhe_config"]); 
 	mhe.set_config(mhe_config);
-	mhe.estim.build_problem();
+	mhe.build_problem();
 	mhe.start();
 
 	MPC_handler<M> mpc;
@@ -44,7 +44,7 @@ int main(int argc, char const *argv[])
 	
 	MHE_handler<M> mhe;
 	mhe.set_config(mhe_config);
-	mhe.estim.build_problem();
+	mhe.build_problem();
 	mhe.start();
 
 
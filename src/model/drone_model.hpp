@@ -161,6 +161,7 @@ public:
 	static const int u_dim = 0;
 	static const int o_dim = 0;
 	static const int p_dim = 0;
+	static const int a_idx = -1; // angle in s and o, wraps around
 
 	typedef Eigen::Vector<double, s_dim> s_vec;
 	typedef Eigen::Vector<double, u_dim> u_vec;
@@ -201,6 +202,7 @@ public:
 	static const int u_dim = 4;
 	static const int o_dim = 4;
 	static const int p_dim = 4;
+	static const int a_idx = 3;
 
 
 	typedef Eigen::Vector<double, s_dim> s_vec;
@@ -225,6 +227,14 @@ public:
 
 	static s_vec predict_state(const s_vec s0, const list<u_vec> u_list, const p_vec p, double dt) 
 		{ return Base_model::predict_state<Simple_drone_model>(s0, u_list, p, dt); };
+
+	// linear parametrization ds = phi(s, u)*theta,
+	// theta = (c_h*cos(e_a), c_h*sin(e_a), c_v, c_a)
+	typedef Eigen::Matrix<double, s_dim, p_dim> phi_mat;
+
+	static void lin_regressor(phi_mat &phi, const s_vec &s, const u_vec &u);
+	static p_vec params_to_lin(const p_vec &p);
+	static p_vec lin_to_params(const p_vec &theta);
 };
 
 class Drift_drone_model : Base_model
@@ -247,6 +257,7 @@ public:
 	static const int u_dim = 4;
 	static const int o_dim = 4;
 	static const int p_dim = 4;
+	static const int a_idx = 3;
 
 
 	typedef Eigen::Vector<double, s_dim> s_vec;
@@ -303,6 +314,7 @@ public:
 	static const int u_dim = 4;
 	static const int o_dim = 4;
 	static const int p_dim = 7;
+	static const int a_idx = 3;
 
 	typedef Eigen::Vector<double, s_dim> s_vec;
 	typedef Eigen::Vector<double, u_dim> u_vec;
@@ -377,6 +389,31 @@ bool Simple_drone_model::output_eq(To *o, const Ts *s)
 	return true;
 }
 
+/* state eq is linear in theta, columns of the regressor
+ * are the state eq evaluated at the unit vectors of theta
+ */
+inline void Simple_drone_model::lin_regressor(phi_mat &phi, const s_vec &s, const u_vec &u)
+{
+	const double basis[p_dim][p_dim] = {
+		{1, 0, 0, 0},
+		{1, 0, 0, M_PI/2},
+		{0, 1, 0, 0},
+		{0, 0, 1, 0}};
+
+	for (int j = 0; j < p_dim; j++)
+		state_eq(phi.col(j).data(), s.data(), u.data(), basis[j]);
+}
+
+inline Simple_drone_model::p_vec Simple_drone_model::params_to_lin(const p_vec &p)
+{
+	return p_vec(p[0]*cos(p[3]), p[0]*sin(p[3]), p[1], p[2]);
+}
+
+inline Simple_drone_model::p_vec Simple_drone_model::lin_to_params(const p_vec &theta)
+{
+	return p_vec(hypot(theta[0], theta[1]), theta[2], theta[3], atan2(theta[1], theta[0]));
+}
+
 /* innertia drone mode:
  * s = (x, y, z, a, dx, dy, dz, da)
  * u = (pitch, roll, yaw, throttle)
@@ -28,6 +28,7 @@ public:
 
 		this->s_noise_sd.setZero();
 		this->o_noise_sd.setZero();
+		this->o_last.setZero();
 		
 
 		p_lb = array_to_vector<M::p_dim>(M::p_lb);
@@ -63,6 +64,8 @@ public:
 	int u_delay_max_diff = 0; // max_diff
 
 	double o_miss_prob = 0;
+	bool o_valid = true; // false if the last observation was missed
+	o_vec o_last; // last valid observation, returned on miss
 	double dt = 1;
 private:
 	uniform_real_distribution<double> uniform_dist;
@@ -79,18 +82,20 @@ typename Model_sim<M>::o_vec Model_sim<M>::obs()
 {
 	o_vec obs;
 	M::output_eq(obs.data(), this->state.data());
-	
+
+	for (int i = 0; i < M::o_dim; i++) {
+		obs[i] += this->o_noise_sd[i]*this->normal_dist(this->rng);
+	}
+
+	this->o_valid = true;
 	if (this->o_miss_prob > 0) {
 		if (this->uniform_dist(this->rng) < this->o_miss_prob) {
-			obs.setZero();
+			this->o_valid = false;
+			return this->o_last;
 		}
 	}
 
-	for (int i = 0; i < M::o_dim; i++) {
-		obs[i] += this->o_noise_sd[i]*this->normal_dist(this->rng);
-	}
-	
-	
+	this->o_last = obs;
 
 	return obs;
 }
@@ -101,6 +106,7 @@ typename Model_sim<M>::o_vec Model_sim<M>::reset()
 	this->u_buffer.clear();
 	this->state.setZero();
 	this->s_drift.setZero();
+	this->o_last.setZero();
 
 	this->u_delay_curr = u_delay;
 
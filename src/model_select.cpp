@@ -0,0 +1,198 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <cmath>
+
+#include <eigen3/Eigen/Dense>
+#include <ceres/ceres.h>
+
+#include "optim/model_ident.hpp"
+#include "utils/parser.hpp"
+#include "utils/json.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+using json = nlohmann::json;
+
+string default_config = "/home/jsv/CVUT/master-thesis/config/model_select.json";
+
+// identifies every model class in its own thread on the same trajectories,
+// every select_holdout-th trajectory is held out, its states are estimated with
+// the identified parameters fixed and the outputs are predicted select_horizon steps ahead,
+// prints csv: model, time [s], final cost, prediction rmse, aic, bic
+
+typedef Model_ident<Simple_drone_model>::o_mat o_mat;
+typedef Model_ident<Simple_drone_model>::u_mat u_mat;
+
+struct select_result
+{
+	string name;
+	bool done = false;
+
+	double time = 0;
+	double cost = 0;
+	double rss = 0; // sum of squared prediction errors
+	int n = 0; // number of predicted outputs
+	int k = 0; // number of parameters
+};
+
+template<typename M>
+void select_worker(json config, vector<o_mat> *pos, vector<u_mat> *input,
+	int holdout, int horizon, select_result *result)
+{
+	static_assert(M::o_dim == Simple_drone_model::o_dim && M::u_dim == Simple_drone_model::u_dim);
+
+	int u_delay = config["u_delay"];
+	double dt = config["dt"];
+
+	// trajectories are shared read-only by all models
+	Model_ident<M> train;
+	Model_ident<M> test;
+	train.set_config(config);
+	test.set_config(config);
+	train.owns_data = false;
+	test.owns_data = false;
+	train.solver_options.minimizer_progress_to_stdout = false;
+	test.solver_options.minimizer_progress_to_stdout = false;
+
+	for (int k = 0; k < pos->size(); k++) {
+		if (holdout > 0 && k % holdout == holdout - 1)
+			test.add_trajectory_data(&(*pos)[k], &(*input)[k]);
+		else
+			train.add_trajectory_data(&(*pos)[k], &(*input)[k]);
+	}
+
+	ceres::Solver::Summary summary;
+	auto start = steady_clock::now();
+	train.build_problem(u_delay);
+	train.solve(&summary);
+	auto end = steady_clock::now();
+
+	result->time = duration_cast<microseconds>(end - start).count()*1e-6;
+	result->cost = summary.final_cost;
+	result->k = M::p_dim;
+	for (auto p_shift : train.param_shift_est)
+		result->k += p_shift->size(); // parameter shift segments are free parameters too
+
+	if (test.pos_data.size() == 0) {
+		result->done = true;
+		return;
+	}
+
+	// states of the held-out trajectories with the identified parameters
+	test.param_prior = train.param_est;
+	test.build_problem(u_delay);
+	test.problem->SetParameterBlockConstant(test.param_est.data());
+	test.solve(&summary);
+
+	typename M::o_vec o;
+	typename M::s_vec s;
+	list<typename M::u_vec> u_list;
+	for (int k = 0; k < test.pos_data.size(); k++) {
+		int N = test.pos_data[k]->rows();
+		for (int t = 0; t + horizon < N; t++) {
+			u_list.clear();
+			for (int j = t; j < t + horizon; j++) {
+				u_list.push_back(Eigen::Map<typename M::u_vec>(test.delayed_input(k, j, u_delay)));
+			}
+
+			s = M::predict_state(test.state_est[k]->row(t).transpose(), u_list, train.param_est, dt);
+			M::output_eq(o.data(), s.data());
+
+			result->rss += (o - test.pos_data[k]->row(t + horizon).transpose()).squaredNorm();
+			result->n += M::o_dim;
+		}
+	}
+
+	result->done = true;
+}
+
+int main(int argc, char const *argv[])
+{
+	string config_file = default_config;
+	if (argc > 1)
+		config_file = string(argv[1]);
+
+	json config = get_json_config(config_file);
+
+	int holdout = 5;
+	if (!config["select_holdout"].is_null()) {
+		holdout = config["select_holdout"];
+	}
+
+	int horizon = 25;
+	if (!config["select_horizon"].is_null()) {
+		horizon = config["select_horizon"];
+	}
+
+	int max_models = 1000;
+	if (!config["max_models"].is_null()) {
+		max_models = config["max_models"];
+	}
+
+	vector<o_mat> pos;
+	vector<u_mat> input;
+
+	string log_dir(config["log_dir"]);
+	vector<string> log_files = list_files_in_dir(log_dir);
+
+	char buffer[256];
+	for (int i = 0; i < min((int)log_files.size(), max_models); i++) {
+		sprintf(buffer, "%s/%s", log_dir.c_str(), log_files[i].c_str());
+		auto data = Parser::parse_log(buffer,
+			{"input", "pos"},
+			{1, 1});
+
+		pos.emplace_back();
+		input.emplace_back();
+		Parser::fill_matrix<Simple_drone_model::o_dim>(pos.back(), data["pos"]);
+		Parser::fill_matrix<Simple_drone_model::u_dim>(input.back(), data["input"]);
+	}
+
+	cerr << "loaded " << pos.size() << " trajectories" << endl;
+
+	// models without a config are skipped
+	json model_configs = config["select_models"];
+	vector<select_result> results(3);
+	vector<thread> workers;
+
+	results[0].name = "simple";
+	results[1].name = "drift";
+	results[2].name = "innertia";
+
+	if (!model_configs["simple"].is_null())
+		workers.push_back(thread(select_worker<Simple_drone_model>, get_json_config(model_configs["simple"]),
+			&pos, &input, holdout, horizon, &results[0]));
+
+	if (!model_configs["drift"].is_null())
+		workers.push_back(thread(select_worker<Drift_drone_model>, get_json_config(model_configs["drift"]),
+			&pos, &input, holdout, horizon, &results[1]));
+
+	if (!model_configs["innertia"].is_null())
+		workers.push_back(thread(select_worker<Innertia_drone_model>, get_json_config(model_configs["innertia"]),
+			&pos, &input, holdout, horizon, &results[2]));
+
+	for (auto &w : workers)
+		w.join();
+
+	cout << "model,time,cost,rmse,aic,bic" << endl;
+	for (auto &r : results) {
+		if (!r.done)
+			continue;
+
+		double rmse = NAN, aic = NAN, bic = NAN;
+		if (r.n > 0) {
+			rmse = sqrt(r.rss/r.n);
+			aic = r.n*log(r.rss/r.n) + 2*r.k;
+			bic = r.n*log(r.rss/r.n) + r.k*log(r.n);
+		}
+
+		cout << r.name << "," << r.time << "," << r.cost << "," << rmse << "," << aic << "," << bic << endl;
+	}
+
+	return 0;
+}
@@ -9,7 +9,9 @@
 
 #include "model/drone_model.hpp"
 #include "optim/mhe.hpp"
+#include "optim/mhe_delay.hpp"
 #include "optim/mpc.hpp"
+#include "optim/rls.hpp"
 #include "tello/tello.h"
 #include "vicon/vicon_handler.hpp"
 #include "filter/vicon_filter.hpp"
@@ -138,10 +140,27 @@ int main(int argc, char const *argv[])
 		io_config["filter_angle_threshold"]);
 
 	MHE_handler<M> mhe;
+	MHE_delay_handler<M> mhe_delay;
 	json mhe_config = get_json_config(io_config["mhe_config"]); 
-	mhe.set_config(mhe_config);
-	mhe.estim.build_problem();
-	mhe.start();
+	bool delay_est = !mhe_config["u_delays"].is_null(); // estimate delay with multiple hypotheses
+	if (delay_est) {
+		mhe_delay.set_config(mhe_config);
+		mhe_delay.build_problem();
+		mhe_delay.start();
+	}
+	else {
+		mhe.set_config(mhe_config);
+		mhe.build_problem();
+		mhe.start();
+	}
+
+	RLS_handler<M> rls;
+	bool rls_est = !io_config["rls_config"].is_null(); // online parameters for the mpc
+	if (rls_est) {
+		json rls_config = get_json_config(io_config["rls_config"]);
+		rls.set_config(rls_config);
+		rls.start();
+	}
 
 	MPC_handler<M> mpc;
 	json mpc_config = get_json_config(io_config["mpc_config"]); 
@@ -157,10 +176,31 @@ int main(int argc, char const *argv[])
 	pos_t raw_pos, filt_pos;
 
 	M::s_vec s_est, s_predict, s_target, target_diff, s_mpc_tar;
-	M::p_vec p_est, p_corr, p_mpc;
-	list<M::u_vec> u_buffer;
+	M::p_vec p_est, p_corr, p_mpc, p_rls;
+	MHE_handler<M>::s_mat s_cov = MHE_handler<M>::s_mat::Zero();
+	MHE_handler<M>::p_mat p_cov = MHE_handler<M>::p_mat::Zero();
+	M::s_vec s_sd;
+	M::p_vec p_sd;
+	list<M::u_vec> u_buffer, u_predict;
 	M::u_vec u_mpc;
 	int u_delay = io_config["u_delay"]; 
+	int u_buffer_len = u_delay;
+	if (delay_est) {
+		for (int d : mhe_config["u_delays"])
+			u_buffer_len = max(u_buffer_len, d);
+	}
+
+	bool vicon_stamps = false; // feed mhe every vicon frame with its time stamp
+	if (!io_config["vicon_stamps"].is_null()) {
+		vicon_stamps = io_config["vicon_stamps"];
+	}
+	if (vicon_stamps && delay_est) {
+		cerr << "vicon_stamps can not be combined with the MHE delay estimation!" << endl;
+		exit(EXIT_FAILURE);
+	}
+	bool frame_valid = false; // a valid frame arrived in this step, stamped mode
+	vector<CViconObject> vicon_frames;
+	CViconObject vicon_obj;
 
 	p_corr = array_to_vector(mpc_config["par_correction"]);
 
@@ -194,7 +234,11 @@ int main(int argc, char const *argv[])
 		input_target.throttle = keyboard_hndl['i'] - keyboard_hndl['k'];
 		input_target.yaw = keyboard_hndl['j'] - keyboard_hndl['l'];	
 
-		raw_pos = vicon_hndl();
+		vicon_obj = vicon_hndl();
+		raw_pos = vicon_obj;
+		if (vicon_stamps) {
+			vicon_frames = vicon_hndl.get_new_vals();
+		}
 
 		if (keyboard_hndl['e'] & ctrl_step != -1) { // manual control
 			cout << "\nMANUAL CONTROL" << endl;
@@ -206,8 +250,16 @@ int main(int argc, char const *argv[])
 		}
 
 		if (ctrl_step > -2) {
-			filt_pos = vicon_filter.step(raw_pos, 1);
-			mhe.get_est(s_est, p_est, ts);
+			if (!vicon_stamps) {
+				filt_pos = vicon_filter.step(raw_pos, !vicon_obj.occluded);
+			}
+			if (delay_est) {
+				mhe_delay.get_est(s_est, p_est, s_cov, p_cov, ts);
+				u_delay = mhe_delay.get_delay();
+			}
+			else {
+				mhe.get_est(s_est, p_est, s_cov, p_cov, ts);
+			}
 			u_mpc = mpc.u_vector(ts);
 		}
 
@@ -226,6 +278,8 @@ int main(int argc, char const *argv[])
 			done = true;
 			logger.close();
 			mhe.end();
+			mhe_delay.end();
+			rls.end();
 			mpc.end();
 
 		}
@@ -247,15 +301,42 @@ int main(int argc, char const *argv[])
 
 
 		u_buffer.push_back(input.data);
-		while (u_buffer.size() > u_delay + 1)
+		while (u_buffer.size() > u_buffer_len + 1)
 		{
 			u_buffer.pop_front();
 		}
 
+		// inputs not yet applied because of the delay
+		u_predict.assign(prev(u_buffer.end(), min((int)u_buffer.size(), u_delay + 1)), u_buffer.end());
+
 		if (ctrl_step > -2) {
-			mhe.post_request(ts, filt_pos.data, u_buffer.front());
-			s_predict = M::predict_state(s_est, u_buffer, p_est, 0.02);
+			if (delay_est) {
+				mhe_delay.post_request(ts, filt_pos.data, u_buffer.back(), vicon_filter.last_valid());
+			}
+			else if (vicon_stamps) {
+				frame_valid = false;
+				for (auto &frame : vicon_frames) {
+					raw_pos = frame;
+					filt_pos = vicon_filter.step(raw_pos, !frame.occluded);
+					frame_valid = vicon_filter.last_valid();
+					double stamp = (frame.frameRate > 0) ? frame.frameNumber/frame.frameRate : -1;
+					mhe.post_request(ts, filt_pos.data, u_predict.front(), stamp, vicon_filter.last_valid());
+				}
+				mhe.post_input(ts, u_predict.front());
+			}
+			else {
+				mhe.post_request(ts, filt_pos.data, u_predict.front(), -1, vicon_filter.last_valid());
+			}
+			if (rls_est) {
+				// stamped, filt_pos is the last frame of the step, stale if none arrived
+				bool valid = vicon_stamps ? frame_valid : vicon_filter.last_valid();
+				rls.post_request(ts, filt_pos.data, u_predict.front(), valid);
+			}
+			s_predict = M::predict_state(s_est, u_predict, p_est, 0.02);
 			p_mpc = p_est + p_corr;
+			if (rls_est && rls.get_params(p_rls, ts + 1)) {
+				p_mpc = p_rls; // replaces the static correction
+			}
 			mpc.post_request(ts+1, s_predict, u_buffer.back(), s_target, p_mpc);
 
 			target_diff = s_target - s_est;
@@ -291,6 +372,17 @@ int main(int argc, char const *argv[])
 			logger << "input" << log_timestep << input.data << '\n';
 			logger << "target" << log_timestep << s_target << '\n';
 			logger << "param" << log_timestep << p_est << '\n';
+			if (rls_est) {
+				logger << "param_mpc" << log_timestep << p_mpc << '\n';
+			}
+			s_sd = s_cov.diagonal().cwiseSqrt();
+			p_sd = p_cov.diagonal().cwiseSqrt();
+			logger << "pos_sd" << log_timestep << s_sd << '\n';
+			logger << "param_sd" << log_timestep << p_sd << '\n';
+			if (delay_est) {
+				logger << "delay" << log_timestep << u_delay << '\n';
+				logger << "delay_cost" << log_timestep << mhe_delay.get_costs() << '\n';
+			}
 
 			log_timestep += 1;
 		}
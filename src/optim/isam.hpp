@@ -0,0 +1,482 @@
+#ifndef __ISAM_HPP__
+#define __ISAM_HPP__
+
+#include <deque>
+#include <algorithm>
+#include <cassert>
+
+#include <eigen3/Eigen/Dense>
+#include <ceres/ceres.h>
+
+#include "utils/aux.hpp"
+#include "utils/json.hpp"
+#include "optim/kf.hpp"
+#include "optim/residuals.hpp"
+
+using namespace std;
+using namespace ceres;
+using json = nlohmann::json;
+
+template<typename M>
+class ISAM_estimator : public KF_estimator<M>
+{
+/* incremental smoother over a long window of states s_0 ... s_n and parameters p,
+ * factors are the MHE residuals (Obs_mhe_res, State_mhe_res, Prior_res),
+ * each factor keeps its linearization, the information matrix is eliminated
+ * from the oldest state to the newest and the elimination is cached,
+ * a new sample only changes the last states so only they are re-eliminated,
+ * states are relinearized only when their update exceeds relin_thr and only
+ * the elimination from the first relinearized state is redone, parameters enter
+ * every transition so their relinearization (update above relin_p_thr) redoes
+ * the whole elimination, old states are marginalized into a prior on (s_0, p)
+ *
+ * uses the filter interface of KF_estimator:
+ * predict adds a new state and propagates x and P through the linearized
+ * transition as the ekf, update adds its observation and solves,
+ * P holds the marginal covariance of the last state and p from the elimination
+ */
+public:
+	typedef KF_estimator<M> Base;
+	typedef typename Base::x_mat x_mat;
+	typedef typename M::s_vec s_vec;
+	typedef typename M::u_vec u_vec;
+	typedef typename M::o_vec o_vec;
+	typedef typename M::p_vec p_vec;
+
+	typedef Eigen::Matrix<double, M::s_dim, M::s_dim> ss_mat;
+	typedef Eigen::Matrix<double, M::s_dim, M::p_dim> sp_mat;
+	typedef Eigen::Matrix<double, M::p_dim, M::p_dim> pp_mat;
+
+	struct node
+	{
+		s_vec s; // linearization point
+		s_vec ds; // update from the linearization point
+
+		o_vec o;
+		u_vec u; // input of transition to next state
+		double dt; // interval of transition to next state
+		double w = 1;
+
+		CostFunction *obs_cost = nullptr;
+		CostFunction *state_cost = nullptr; // transition to next state
+
+		// linearized factors
+		Eigen::Matrix<double, M::o_dim, M::s_dim, Eigen::RowMajor> J_o;
+		o_vec r_o;
+
+		Eigen::Matrix<double, M::s_dim, M::s_dim, Eigen::RowMajor> J_s0;
+		Eigen::Matrix<double, M::s_dim, M::s_dim, Eigen::RowMajor> J_s1;
+		Eigen::Matrix<double, M::s_dim, M::p_dim, Eigen::RowMajor> J_p;
+		s_vec r_s;
+
+		// elimination of this state, A ds + C ds_next + E dp = b
+		Eigen::LDLT<ss_mat> A_ldlt;
+		ss_mat C;
+		sp_mat E;
+		s_vec b;
+
+		// parameter block after eliminating states up to this one
+		pp_mat H_p;
+		p_vec b_p;
+
+		// passed to the next state by the elimination
+		ss_mat in_A;
+		sp_mat in_E;
+		s_vec in_b;
+	};
+
+	struct marginal_prior
+	{
+		bool active = false;
+
+		ss_mat H_ss;
+		sp_mat H_sp;
+		pp_mat H_pp;
+		s_vec b_s;
+		p_vec b_p;
+
+		s_vec s_lin; // linearization point of the prior
+		p_vec p_lin;
+	};
+
+	ISAM_estimator() {}
+
+	~ISAM_estimator()
+	{
+		this->clear();
+		delete this->p_prior_cost;
+	}
+
+	void clear()
+	{
+		for (auto nd : this->nodes) {
+			delete nd->obs_cost;
+			delete nd->state_cost;
+			delete nd;
+		}
+		this->nodes.clear();
+		this->prior.active = false;
+		this->dirty = 0;
+	}
+
+	void reset(const p_vec &p_prior_) override
+	{
+		Base::reset(p_prior_);
+		this->clear();
+
+		this->p = this->x.template tail<M::p_dim>();
+		this->dp.setZero();
+	}
+
+	void predict(const u_vec &u, const double dt_) override
+	{
+		node *last = this->nodes.back();
+		node *nd = new node;
+
+		last->u = u;
+		last->dt = dt_;
+		last->state_cost = State_mhe_res<M>::Create(last->u.data(), &(last->dt), this->C_s.data(), &(last->w));
+
+		s_vec s_curr = last->s + last->ds;
+		p_vec p_curr = this->p + this->dp;
+		s_vec ds;
+		M::state_eq(ds.data(), s_curr.data(), u.data(), p_curr.data());
+
+		nd->s = s_curr + dt_*ds;
+		nd->ds.setZero();
+
+		this->nodes.push_back(nd);
+		this->linearize_state(this->nodes.size() - 2);
+		this->dirty = min(this->dirty, (int)this->nodes.size() - 2);
+
+		// residual J_s0 ds + J_s1 ds_next + J_p dp, ds_next = F (ds, dp) with noise J_s1^-1 J_s1^-T,
+		// without observation the estimate is not solved until the next update
+		ss_mat J_s1_inv = last->J_s1.inverse();
+
+		x_mat F;
+		F.setIdentity();
+		F.template topLeftCorner<M::s_dim, M::s_dim>() = -J_s1_inv*last->J_s0;
+		F.template topRightCorner<M::s_dim, M::p_dim>() = -J_s1_inv*last->J_p;
+
+		x_mat Q;
+		Q.setZero();
+		Q.template topLeftCorner<M::s_dim, M::s_dim>() = J_s1_inv*J_s1_inv.transpose();
+
+		this->x.template head<M::s_dim>() = nd->s;
+		this->P = F*this->P*F.transpose() + Q;
+	}
+
+	void update(const o_vec &o_) override
+	{
+		if (this->nodes.empty()) {
+			node *nd = new node;
+			nd->s = this->x.template head<M::s_dim>();
+			nd->ds.setZero();
+			this->nodes.push_back(nd);
+			this->dirty = 0;
+		}
+
+		node *nd = this->nodes.back();
+		nd->o = o_;
+		nd->obs_cost = Obs_mhe_res<M>::Create(nd->o.data(), this->C_o.data(), &(nd->w));
+		this->linearize_obs(this->nodes.size() - 1);
+		this->dirty = min(this->dirty, (int)this->nodes.size() - 1);
+
+		this->solve();
+	}
+
+	void solve()
+	{
+		this->eliminate();
+
+		for (int it = 0; it < this->n_iter; it++) {
+			if (!this->relinearize())
+				break;
+
+			this->eliminate();
+		}
+
+		if ((int)this->nodes.size() > this->h + this->marg_rate) {
+			this->marginalize(this->nodes.size() - this->h);
+		}
+
+		node *last = this->nodes.back();
+		this->x.template head<M::s_dim>() = last->s + last->ds;
+		this->x.template tail<M::p_dim>() = this->p + this->dp;
+
+		this->marginal_cov();
+	}
+
+	void marginal_cov()
+	{
+		// last state is eliminated last, its block and the parameter block
+		// are already factorized
+		node *last = this->nodes.back();
+
+		pp_mat P_pp = this->H_p_ldlt.solve(pp_mat::Identity());
+		sp_mat AiE = last->A_ldlt.solve(last->E);
+
+		this->P.template topLeftCorner<M::s_dim, M::s_dim>() = 
+			last->A_ldlt.solve(ss_mat::Identity()) + AiE*P_pp*AiE.transpose();
+		this->P.template topRightCorner<M::s_dim, M::p_dim>() = -AiE*P_pp;
+		this->P.template bottomLeftCorner<M::p_dim, M::s_dim>() = -P_pp*AiE.transpose();
+		this->P.template bottomRightCorner<M::p_dim, M::p_dim>() = P_pp;
+	}
+
+	void linearize_obs(int i)
+	{
+		node *nd = this->nodes[i];
+		if (nd->obs_cost == nullptr)
+			return;
+
+		const double *params[1] = {nd->s.data()};
+		double *jac[1] = {nd->J_o.data()};
+		nd->obs_cost->Evaluate(params, nd->r_o.data(), jac);
+	}
+
+	void linearize_state(int i)
+	{
+		node *nd = this->nodes[i];
+		if (nd->state_cost == nullptr)
+			return;
+
+		const double *params[3] = {nd->s.data(), this->nodes[i+1]->s.data(), this->p.data()};
+		double *jac[3] = {nd->J_s0.data(), nd->J_s1.data(), nd->J_p.data()};
+		nd->state_cost->Evaluate(params, nd->r_s.data(), jac);
+	}
+
+	bool relinearize()
+	{
+		// move linearization point to the current estimate, returns true if anything changed
+		int n = this->nodes.size();
+		bool changed = false;
+
+		if (this->dp.cwiseAbs().maxCoeff() > this->relin_p_thr) {
+			this->p += this->dp;
+			for (int i = 0; i < M::p_dim; i++)
+				this->p[i] = min(max(this->p[i], this->p_lb[i]), this->p_ub[i]);
+			this->dp.setZero();
+
+			for (int i = 0; i < n - 1; i++)
+				this->linearize_state(i);
+
+			this->dirty = 0;
+			changed = true;
+		}
+
+		for (int i = 0; i < n; i++) {
+			node *nd = this->nodes[i];
+			if (nd->ds.cwiseAbs().maxCoeff() <= this->relin_thr)
+				continue;
+
+			nd->s += nd->ds;
+			nd->ds.setZero();
+
+			this->linearize_obs(i);
+			if (i > 0)
+				this->linearize_state(i - 1);
+			if (i < n - 1)
+				this->linearize_state(i);
+
+			this->dirty = min(this->dirty, max(i - 1, 0));
+			changed = true;
+		}
+
+		return changed;
+	}
+
+	void eliminate()
+	{
+		// forward elimination from the first changed state, then back substitution
+		int n = this->nodes.size();
+
+		ss_mat A;
+		sp_mat E;
+		s_vec b;
+		pp_mat H_p;
+		p_vec b_p;
+
+		for (int i = this->dirty; i < n; i++) {
+			node *nd = this->nodes[i];
+
+			if (i == 0) {
+				this->prior_terms(A, E, b, H_p, b_p);
+			}
+			else {
+				node *prev = this->nodes[i-1];
+				A = prev->in_A;
+				E = prev->in_E;
+				b = prev->in_b;
+				H_p = prev->H_p;
+				b_p = prev->b_p;
+			}
+
+			if (nd->obs_cost != nullptr) {
+				A += nd->J_o.transpose()*nd->J_o;
+				b -= nd->J_o.transpose()*nd->r_o;
+			}
+
+			if (i < n - 1) {
+				A += nd->J_s0.transpose()*nd->J_s0;
+				E += nd->J_s0.transpose()*nd->J_p;
+				b -= nd->J_s0.transpose()*nd->r_s;
+				H_p += nd->J_p.transpose()*nd->J_p;
+				b_p -= nd->J_p.transpose()*nd->r_s;
+				nd->C = nd->J_s0.transpose()*nd->J_s1;
+			}
+			else {
+				nd->C.setZero();
+			}
+
+			A.diagonal().array() += this->eps;
+
+			nd->A_ldlt.compute(A);
+			nd->E = E;
+			nd->b = b;
+
+			sp_mat AiE = nd->A_ldlt.solve(E);
+			s_vec Aib = nd->A_ldlt.solve(b);
+
+			nd->H_p = H_p - E.transpose()*AiE;
+			nd->b_p = b_p - E.transpose()*Aib;
+
+			if (i < n - 1) {
+				ss_mat AiC = nd->A_ldlt.solve(nd->C);
+				nd->in_A = nd->J_s1.transpose()*nd->J_s1 - nd->C.transpose()*AiC;
+				nd->in_E = nd->J_s1.transpose()*nd->J_p - nd->C.transpose()*AiE;
+				nd->in_b = -nd->J_s1.transpose()*nd->r_s - nd->C.transpose()*Aib;
+			}
+		}
+
+		this->dirty = n;
+
+		// parameter prior is added last, it does not change the cached elimination
+		p_vec r_pp;
+		Eigen::Matrix<double, M::p_dim, M::p_dim, Eigen::RowMajor> J_pp;
+		const double *params[1] = {this->p.data()};
+		double *jac[1] = {J_pp.data()};
+		this->p_prior_cost->Evaluate(params, r_pp.data(), jac);
+
+		node *last = this->nodes.back();
+		H_p = last->H_p + J_pp.transpose()*J_pp;
+		b_p = last->b_p - J_pp.transpose()*r_pp;
+
+		this->H_p_ldlt.compute(H_p);
+		this->dp = this->H_p_ldlt.solve(b_p);
+
+		s_vec ds_next;
+		ds_next.setZero();
+		for (int i = n - 1; i >= 0; i--) {
+			node *nd = this->nodes[i];
+			nd->ds = nd->A_ldlt.solve(nd->b - nd->E*this->dp - nd->C*ds_next);
+			ds_next = nd->ds;
+		}
+	}
+
+	void prior_terms(ss_mat &A, sp_mat &E, s_vec &b, pp_mat &H_p, p_vec &b_p)
+	{
+		A.setZero();
+		E.setZero();
+		b.setZero();
+		H_p.setZero();
+		b_p.setZero();
+
+		if (!this->prior.active)
+			return;
+
+		// prior is linear around its linearization point
+		s_vec d_s = this->nodes[0]->s - this->prior.s_lin;
+		p_vec d_p = this->p - this->prior.p_lin;
+
+		A = this->prior.H_ss;
+		E = this->prior.H_sp;
+		H_p = this->prior.H_pp;
+		b = this->prior.b_s - this->prior.H_ss*d_s - this->prior.H_sp*d_p;
+		b_p = this->prior.b_p - this->prior.H_sp.transpose()*d_s - this->prior.H_pp*d_p;
+	}
+
+	void marginalize(int k)
+	{
+		// marginalize first k states, the elimination must be up to date
+		assert(this->dirty == (int)this->nodes.size());
+
+		for (int i = 0; i < k; i++) {
+			node *nd = this->nodes.front();
+			node *next = this->nodes[1];
+
+			this->prior.active = true;
+			this->prior.H_ss = nd->in_A;
+			this->prior.H_sp = nd->in_E;
+			this->prior.H_pp = nd->H_p;
+			this->prior.b_s = nd->in_b;
+			this->prior.b_p = nd->b_p;
+			this->prior.s_lin = next->s;
+			this->prior.p_lin = this->p;
+
+			delete nd->obs_cost;
+			delete nd->state_cost;
+			delete nd;
+			this->nodes.pop_front();
+		}
+
+		this->dirty = this->nodes.size();
+	}
+
+	void set_config(json config)
+	{
+		Base::set_config(config);
+
+		this->h = config["h"];
+		if (!config["isam_h"].is_null()) {
+			this->h = config["isam_h"];
+		}
+
+		this->C_s = array_to_vector(config["C_s"]);
+		this->C_o = array_to_vector(config["C_o"]);
+		this->C_p = array_to_vector(config["C_prior"]);
+
+		if (!config["isam_relin_p_thr"].is_null()) {
+			this->relin_p_thr = config["isam_relin_p_thr"];
+		}
+
+		if (!config["isam_relin_thr"].is_null()) {
+			this->relin_thr = config["isam_relin_thr"];
+		}
+
+		if (!config["isam_marg_rate"].is_null()) {
+			this->marg_rate = config["isam_marg_rate"];
+		}
+
+		if (!config["isam_iter"].is_null()) {
+			this->n_iter = config["isam_iter"];
+		}
+
+		delete this->p_prior_cost;
+		this->p_prior_cost = Prior_res<M::p_dim>::Create(this->p_prior.data(), this->C_p.data());
+		this->p = this->p_prior;
+		this->dp.setZero();
+	}
+
+	int h; // number of states kept
+	double relin_thr = 1e-3;
+	double relin_p_thr = 1e-2;
+	int marg_rate = 50;
+	int n_iter = 1;
+	double eps = 1e-9;
+
+	o_vec C_o;
+	s_vec C_s;
+	p_vec C_p;
+
+	deque<node *> nodes;
+	int dirty = 0; // first state with outdated elimination
+
+	p_vec p; // parameter linearization point
+	p_vec dp;
+	Eigen::LDLT<pp_mat> H_p_ldlt;
+
+	marginal_prior prior;
+	CostFunction *p_prior_cost = nullptr;
+};
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef __KF_HPP__
+#define __KF_HPP__
+
+#include <vector>
+#include <mutex>
+
+#include <eigen3/Eigen/Dense>
+#include <ceres/ceres.h>
+
+#include "utils/aux.hpp"
+#include "utils/json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+template<typename M>
+class KF_estimator
+{
+/* kalman filter base on augmented state x = (s, p)
+ * parameters are modeled as random walk,
+ * noise is derived from the MHE weights:
+ * obs sd = 1/C_o, state sd = dt/C_s, param prior sd = 1/C_prior
+ */
+public:
+	typedef typename M::s_vec s_vec;
+	typedef typename M::u_vec u_vec;
+	typedef typename M::o_vec o_vec;
+	typedef typename M::p_vec p_vec;
+
+	typedef Eigen::Matrix<double, M::s_dim, M::s_dim> s_mat;
+	typedef Eigen::Matrix<double, M::p_dim, M::p_dim> p_mat;
+
+	static const int x_dim = M::s_dim + M::p_dim;
+
+	typedef Eigen::Vector<double, x_dim> x_vec;
+	typedef Eigen::Matrix<double, x_dim, x_dim> x_mat;
+	typedef Eigen::Matrix<double, M::o_dim, M::o_dim> o_mat;
+	typedef Eigen::Matrix<double, M::o_dim, x_dim> h_mat;
+
+	KF_estimator()
+	{
+		this->p_lb = array_to_vector<M::p_dim>(M::p_lb);
+		this->p_ub = array_to_vector<M::p_dim>(M::p_ub);
+		this->p_prior = (this->p_lb + this->p_ub)/2;
+
+		this->Q.setZero();
+		this->R.setZero();
+		this->P0.setIdentity();
+	}
+
+	virtual ~KF_estimator() {}
+
+	virtual void reset(const p_vec &p_prior_)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		this->ts = -1;
+		this->x.setZero();
+		this->x.template tail<M::p_dim>() = p_prior_;
+		this->P = this->P0;
+	}
+
+	void get_est(s_vec &s_, p_vec &p_, int t)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		if (t - this->ts <= 0) {
+			return;
+		}
+		s_ = this->x.template head<M::s_dim>();
+		p_ = this->x.template tail<M::p_dim>();
+	}
+
+	void get_cov(s_mat &s_cov_, p_mat &p_cov_)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		s_cov_ = this->P.template topLeftCorner<M::s_dim, M::s_dim>();
+		p_cov_ = this->P.template bottomRightCorner<M::p_dim, M::p_dim>();
+	}
+
+	void post_request(const int ts_, const o_vec &o_, const u_vec &u_, const double dt_, const bool valid)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		if (this->ts < 0 && !valid) {
+			return; // wait for first valid observation
+		}
+
+		if (this->ts < 0) {
+			// first observation, observed states are the first o_dim states
+			this->x.template head<M::o_dim>() = o_;
+		}
+		else {
+			this->predict(u_, dt_);
+		}
+
+		if (valid) {
+			this->update(o_);
+			this->clamp_params();
+		}
+
+		this->ts = ts_;
+	}
+
+	virtual void predict(const u_vec &u, const double dt_) = 0;
+	virtual void update(const o_vec &o) = 0;
+
+	void clamp_params()
+	{
+		for (int i = 0; i < M::p_dim; i++) {
+			this->x[M::s_dim + i] = min(max(this->x[M::s_dim + i], this->p_lb[i]), this->p_ub[i]);
+		}
+	}
+
+	void set_config(json config);
+
+	double dt;
+
+	int ts = -1;
+	x_vec x;
+	x_mat P;
+
+	x_mat P0;
+	x_mat Q;
+	o_mat R;
+
+	p_vec p_prior;
+	p_vec p_lb;
+	p_vec p_ub;
+
+	mutex sol_mtx;
+};
+
+template<typename M>
+void KF_estimator<M>::set_config(json config)
+{
+	this->dt = config["dt"];
+
+	s_vec C_s = array_to_vector(config["C_s"]);
+	o_vec C_o = array_to_vector(config["C_o"]);
+	p_vec C_p = array_to_vector(config["C_prior"]);
+
+	if (!config["p_lb"].is_null()) {
+		this->p_lb = array_to_vector(config["p_lb"]);
+	}
+
+	if (!config["p_ub"].is_null()) {
+		this->p_ub = array_to_vector(config["p_ub"]);
+	}
+
+	this->p_prior = (this->p_lb + this->p_ub)/2;
+
+	if (!config["p_prior"].is_null()) {
+		this->p_prior = array_to_vector(config["p_prior"]);
+	}
+
+	double p_sd = 0;
+	if (!config["kf_p_sd"].is_null()) {
+		p_sd = config["kf_p_sd"];
+	}
+
+	this->Q.setZero();
+	this->R.setZero();
+	this->P0.setIdentity();
+
+	for (int i = 0; i < M::o_dim; i++) {
+		this->R(i, i) = 1/(C_o[i]*C_o[i]);
+		this->P0(i, i) = this->R(i, i);
+	}
+
+	for (int i = 0; i < M::s_dim; i++) {
+		this->Q(i, i) = (this->dt*this->dt)/(C_s[i]*C_s[i]);
+	}
+
+	for (int i = 0; i < M::p_dim; i++) {
+		this->Q(M::s_dim + i, M::s_dim + i) = p_sd*p_sd;
+		this->P0(M::s_dim + i, M::s_dim + i) = 1/(C_p[i]*C_p[i]);
+	}
+}
+
+
+template<typename M>
+class EKF_estimator : public KF_estimator<M>
+{
+/* extended kalman filter, jacobians of state and output eq
+ * are computed by automatic differentiation
+ */
+public:
+	typedef KF_estimator<M> Base;
+	typedef typename Base::u_vec u_vec;
+	typedef typename Base::o_vec o_vec;
+	typedef typename Base::x_vec x_vec;
+	typedef typename Base::x_mat x_mat;
+	typedef typename Base::o_mat o_mat;
+	typedef typename Base::h_mat h_mat;
+
+	typedef ceres::Jet<double, Base::x_dim> x_jet;
+
+	void predict(const u_vec &u, const double dt_) override
+	{
+		x_jet s[M::s_dim];
+		x_jet p[M::p_dim];
+		x_jet ds[M::s_dim];
+
+		for (int i = 0; i < M::s_dim; i++)
+			s[i] = x_jet(this->x[i], i);
+		for (int i = 0; i < M::p_dim; i++)
+			p[i] = x_jet(this->x[M::s_dim + i], M::s_dim + i);
+
+		M::state_eq(ds, s, u.data(), p);
+
+		x_mat F;
+		F.setIdentity();
+		for (int i = 0; i < M::s_dim; i++) {
+			this->x[i] += dt_*ds[i].a;
+			F.row(i) += dt_*ds[i].v.transpose();
+		}
+
+		this->P = F*this->P*F.transpose() + (dt_/this->dt)*this->Q;
+	}
+
+	void update(const o_vec &o_) override
+	{
+		x_jet s[M::s_dim];
+		x_jet o[M::o_dim];
+
+		for (int i = 0; i < M::s_dim; i++)
+			s[i] = x_jet(this->x[i], i);
+
+		M::output_eq(o, s);
+
+		o_vec y;
+		h_mat H;
+		for (int i = 0; i < M::o_dim; i++) {
+			y[i] = o_[i] - o[i].a;
+			H.row(i) = o[i].v.transpose();
+		}
+
+		o_mat S = H*this->P*H.transpose() + this->R;
+		Eigen::Matrix<double, Base::x_dim, M::o_dim> K =
+			S.ldlt().solve(H*this->P.transpose()).transpose();
+
+		this->x += K*y;
+
+		x_mat I_KH = x_mat::Identity() - K*H;
+		this->P = I_KH*this->P*I_KH.transpose() + K*this->R*K.transpose(); // joseph form
+	}
+};
+
+
+template<typename M>
+class UKF_estimator : public KF_estimator<M>
+{
+/* unscented kalman filter with 2*x_dim + 1 sigma points
+ */
+public:
+	typedef KF_estimator<M> Base;
+	typedef typename Base::u_vec u_vec;
+	typedef typename Base::o_vec o_vec;
+	typedef typename Base::x_vec x_vec;
+	typedef typename Base::x_mat x_mat;
+	typedef typename Base::o_mat o_mat;
+
+	static const int n_sigma = 2*Base::x_dim + 1;
+
+	typedef Eigen::Matrix<double, Base::x_dim, n_sigma> sigma_mat;
+	typedef Eigen::Matrix<double, M::o_dim, n_sigma> sigma_o_mat;
+
+	UKF_estimator()
+	{
+		this->set_weights();
+	}
+
+	void set_weights()
+	{
+		const int n = Base::x_dim;
+		this->lambda = this->alpha*this->alpha*(n + this->kappa) - n;
+
+		this->w_m.setConstant(1/(2*(n + this->lambda)));
+		this->w_c.setConstant(1/(2*(n + this->lambda)));
+		this->w_m[0] = this->lambda/(n + this->lambda);
+		this->w_c[0] = this->w_m[0] + (1 - this->alpha*this->alpha + this->beta);
+	}
+
+	void sigma_points(sigma_mat &X)
+	{
+		x_mat S = (Base::x_dim + this->lambda)*this->P;
+		x_mat L;
+
+		Eigen::LLT<x_mat> llt(S);
+		if (llt.info() == Eigen::Success) {
+			L = llt.matrixL();
+		}
+		else {
+			// not positive definite after rounding, square root from LDLT 
+			// with the negative pivots clamped to zero
+			Eigen::LDLT<x_mat> ldlt(S);
+			x_vec d = ldlt.vectorD().cwiseMax(0).cwiseSqrt();
+			L = ldlt.transpositionsP().transpose()*(x_mat(ldlt.matrixL())*d.asDiagonal());
+			cerr << "ukf covariance not positive definite" << endl;
+		}
+
+		X.col(0) = this->x;
+		for (int i = 0; i < Base::x_dim; i++) {
+			X.col(1 + i) = this->x + L.col(i);
+			X.col(1 + Base::x_dim + i) = this->x - L.col(i);
+		}
+	}
+
+	void predict(const u_vec &u, const double dt_) override
+	{
+		sigma_mat X;
+		typename M::s_vec ds;
+
+		this->sigma_points(X);
+
+		for (int j = 0; j < n_sigma; j++) {
+			M::state_eq(ds.data(), X.col(j).data(), u.data(), X.col(j).data() + M::s_dim);
+			X.col(j).template head<M::s_dim>() += dt_*ds;
+		}
+
+		this->x = X*this->w_m;
+
+		this->P = (dt_/this->dt)*this->Q;
+		for (int j = 0; j < n_sigma; j++) {
+			x_vec dx = X.col(j) - this->x;
+			this->P += this->w_c[j]*dx*dx.transpose();
+		}
+	}
+
+	void update(const o_vec &o_) override
+	{
+		sigma_mat X;
+		sigma_o_mat Z;
+
+		this->sigma_points(X);
+
+		for (int j = 0; j < n_sigma; j++) {
+			M::output_eq(Z.col(j).data(), X.col(j).data());
+		}
+
+		o_vec z = Z*this->w_m;
+
+		o_mat P_zz = this->R;
+		Eigen::Matrix<double, Base::x_dim, M::o_dim> P_xz;
+		P_xz.setZero();
+
+		for (int j = 0; j < n_sigma; j++) {
+			o_vec dz = Z.col(j) - z;
+			x_vec dx = X.col(j) - this->x;
+			P_zz += this->w_c[j]*dz*dz.transpose();
+			P_xz += this->w_c[j]*dx*dz.transpose();
+		}
+
+		Eigen::Matrix<double, Base::x_dim, M::o_dim> K =
+			P_zz.ldlt().solve(P_xz.transpose()).transpose();
+
+		this->x += K*(o_ - z);
+		this->P -= K*P_zz*K.transpose();
+	}
+
+	void set_config(json config)
+	{
+		Base::set_config(config);
+
+		if (!config["ukf_alpha"].is_null()) {
+			this->alpha = config["ukf_alpha"];
+		}
+
+		if (!config["ukf_beta"].is_null()) {
+			this->beta = config["ukf_beta"];
+		}
+
+		if (!config["ukf_kappa"].is_null()) {
+			this->kappa = config["ukf_kappa"];
+		}
+
+		this->set_weights();
+	}
+
+	double alpha = 1; // with kappa 0 all weights are non-negative
+	double beta = 2;
+	double kappa = 0;
+	double lambda;
+
+	Eigen::Vector<double, n_sigma> w_m;
+	Eigen::Vector<double, n_sigma> w_c;
+};
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef __MHE_HPP__
+#define __MHE_HPP__
+
 #include <vector>
 #include <list>
 #include <atomic>
@@ -11,104 +14,14 @@
 #include "utils/aux.hpp"
 #include "utils/json.hpp"
 #include "optim/model_ident.hpp"
+#include "optim/residuals.hpp"
+#include "optim/kf.hpp"
+#include "optim/isam.hpp"
 
 using namespace std;
 using namespace ceres;
 using json = nlohmann::json;
 
-template<typename M>
-struct Obs_mhe_res
-{
-	Obs_mhe_res(const double *obs, const double *C, double *w) :
-		obs(obs), C(C), w(w) {}
-	
-	template <typename T>
-	bool operator()(const T* const s, T* residual) const 
-	{
-		T o[M::o_dim];
-		M::output_eq(o, s);
-
-		for (int i = 0; i < M::o_dim; i++) {
-			residual[i] = this->w[0]*this->C[i]*(o[i] - this->obs[i]);
-		}
-
-		return true;
-	}
-
-	static CostFunction* Create(const double *obs, const double *C, double *w) {
-		return (new AutoDiffCostFunction<Obs_mhe_res, M::o_dim, M::s_dim>(new Obs_mhe_res(obs, C, w)));
-	}
-
-	
-	
-	const double *obs;
-	const double *C; // cost multipliers
-	double *w;
-};
-
-template<typename M>
-struct State_mhe_res
-{
-	State_mhe_res(const double *u, const double dt, const double *C, double *w) :
-		u(u), dt(dt), C(C), w(w) {}
-	
-	template <typename T>
-	bool operator()(const T* const s_curr, const T* const s_next,
-		const T* const p, T* res) const
-	{
-		T ds[M::s_dim];
-		M::state_eq(ds, s_curr, this->u, p);
-
-		for(int i = 0; i < M::s_dim; i++) {
-			res[i] = this->w[0]*this->C[i]*((s_curr[i] - s_next[i])/this->dt + ds[i]);
-		}
-
-		return true;
-	}
-
-
-	static CostFunction* Create(const double* u, const double dt, const double *C, double *w) {
-		return (new AutoDiffCostFunction<State_mhe_res, M::s_dim, M::s_dim, M::s_dim, M::p_dim>(new State_mhe_res(u, dt, C, w)));
-	}
-
-	const double *u;
-	const double dt;
-	const double *C; // cost multiplier
-	double *w;
-};
-
-template<typename M>
-struct State_mhe_prior_res
-{
-	State_mhe_prior_res(const double *s0, const double *u, const double dt, const double *C, double *w) :
-		s0(s0), u(u), dt(dt), C(C), w(w) {}
-	
-	template <typename T>
-	bool operator()(const T* const s_next,	const T* const p, T* res) const
-	{
-		T ds[M::s_dim];
-		M::state_eq(ds, this->s0, this->u, p);
-
-		for(int i = 0; i < M::s_dim; i++) {
-			res[i] = this->w[0]*this->C[i]*((this->s0[i] - s_next[i])/this->dt + ds[i]);
-		}
-
-		return true;
-	}
-
-
-	static CostFunction* Create(const double *s0, const double* u, const double dt, const double *C, double *w) {
-		return (new AutoDiffCostFunction<State_mhe_prior_res, M::s_dim, M::s_dim, M::p_dim>(new State_mhe_prior_res(s0, u, dt, C, w)));
-	}
-
-	const double *s0;
-	const double *u;
-	const double dt;
-	const double *C; // cost multiplier
-	double *w;
-};
-
-
 template<typename M>
 class MHE_estimator
 {
@@ -118,10 +31,17 @@ public:
 	typedef typename M::o_vec o_vec;
 	typedef typename M::p_vec p_vec;
 
+	typedef Eigen::Matrix<double, M::s_dim, M::s_dim> s_mat;
+	typedef Eigen::Matrix<double, M::p_dim, M::p_dim> p_mat;
+	typedef Eigen::Matrix<double, M::s_dim, M::p_dim> sp_mat;
+
 	MHE_estimator()
 	{
 		this->p_lb = array_to_vector<M::p_dim>(M::p_lb);
 		this->p_ub = array_to_vector<M::p_dim>(M::p_ub);
+
+		this->s_cov.setZero();
+		this->p_cov.setZero();
 	}
 
 	~MHE_estimator()
@@ -131,24 +51,58 @@ public:
 
 	void delete_all()
 	{
-		delete this->obs_loss;
-		this->obs_loss = nullptr;
+		this->delete_problem();
+
+		delete[] this->arena;
+		this->arena = nullptr;
+		this->arena_h = 0;
+	}
+
+	void delete_problem()
+	{
+		delete this->problem; // problem does not own the loss and cost functions
+		this->problem = nullptr;
 
-		// delete this->s_arr;
-		// this->s_arr = nullptr;
-		// // delete this->o_arr; // possible memory leak
-		// this->o_arr = nullptr;
-		// delete this->u_arr;
-		// this->u_arr = nullptr;
+		for (auto cost_fun : this->obs_cost)
+			delete cost_fun;
+		for (auto cost_fun : this->state_cost)
+			delete cost_fun;
+		delete this->param_prior_cost;
 
-		// delete this->p_est;
-		// this->p_est = nullptr;
+		this->obs_cost.clear();
+		this->state_cost.clear();
+		this->param_prior_cost = nullptr;
+		this->obs_id.clear();
+		this->state_id.clear();
+
+		delete this->obs_loss;
+		this->obs_loss = nullptr;
 
 		delete this->state_loss;
 		this->state_loss = nullptr;
+	}
 
-		// delete this->problem;
-		// this->problem = nullptr;
+	void alloc_arena(int h_)
+	{
+		// one block for all arrays of horizon h_, the active window is its end
+		delete[] this->arena;
+		this->arena_h = h_;
+		this->arena = new double[M::p_dim + (3 + M::o_dim + M::u_dim)*h_ + M::s_dim*(h_ + 1)];
+
+		double *ptr = this->arena;
+		this->p_est = ptr;
+		ptr += M::p_dim;
+		this->w_arr = ptr;
+		ptr += h_;
+		this->w_o_arr = ptr;
+		ptr += h_;
+		this->dt_full_arr = ptr;
+		ptr += h_;
+		this->s_arr = ptr; // we are gonna use the last estimate as prior so h+1
+		ptr += M::s_dim*(h_ + 1);
+		this->o_arr = ptr;
+		ptr += M::o_dim*h_;
+		this->u_arr = ptr;
 	}
 
 	void shift_arr(int t)
@@ -160,6 +114,8 @@ public:
 			t = this->h-1;
 
 		memmove((void *)this->w, (void *)(&(this->w[t])), (this->h - t)*sizeof(double));
+		memmove((void *)this->w_o, (void *)(&(this->w_o[t])), (this->h - t)*sizeof(double));
+		memmove((void *)this->dt_arr, (void *)(&(this->dt_arr[t])), (this->h - t)*sizeof(double));
 		memmove((void *)this->s[0], (void *)this->s[t], M::s_dim*(this->h+1-t)*sizeof(double));
 		memmove((void *)this->o[0], (void *)this->o[t], M::o_dim*(this->h-t)*sizeof(double));
 		memmove((void *)this->u[0], (void *)this->u[t], M::u_dim*(this->h-t)*sizeof(double));
@@ -167,61 +123,161 @@ public:
 
 	void zero_arr()
 	{
-		memset(this->w, 0, this->h*sizeof(double));
+		const int n = this->arena_h;
+		memset(this->arena, 0, (M::p_dim + (3 + M::o_dim + M::u_dim)*n + M::s_dim*(n + 1))*sizeof(double));
+		for (int t = 0; t < n; t++)
+			this->dt_full_arr[t] = this->dt;
+	}
+
+	void push_samples(const vector<o_vec> &o_, const vector<u_vec> &u_, const vector<double> &dt_, 
+		const vector<bool> &valid_, const double *p)
+	{
+		// shift the window and append new samples, states are propagated using p
+		// dt_ are the intervals between the previous and the current sample
+		// invalid (missing) samples keep the transition but have zero observation weight
+		int n = o_.size();
+		int k0 = max(0, n - this->h); // more samples than horizon, keep only the last h
+
+		this->shift_arr(n);
+
+		s_vec ds;
+		double *s_curr, *s_next;
+		for (int k = k0; k < n; k++) {
+			int t = this->h - n + k;
+
+			this->w[t] = 1;
+			this->w_o[t] = valid_[k] ? 1 : 0;
+			this->dt_arr[t] = dt_[k];
+			memcpy(this->o[t], o_[k].data(), M::o_dim*sizeof(double));
+			memcpy(this->u[t], u_[k].data(), M::u_dim*sizeof(double));
 
-		memset(this->s_arr, 0, M::s_dim*(this->h+1)*sizeof(double));
-		memset(this->o_arr, 0, M::o_dim*this->h*sizeof(double));
-		memset(this->u_arr, 0, M::u_dim*this->h*sizeof(double));
+			s_curr = this->s[t];
+			s_next = this->s[t+1];
 
-		memset(this->p_est, 0, M::p_dim*sizeof(double));
+			M::state_eq(ds.data(), s_curr, this->u[t], p);
+
+			for (int i = 0; i < M::s_dim; i++) {
+				s_next[i] = s_curr[i] + this->dt_arr[t]*ds[i];
+			}
+		}
 	}
 
 	void build_problem()
 	{
-		this->problem = new Problem();
+		// terms of the whole arena are created once, only the ones of the window
+		// (active end of the arena) are in the problem, so the solve scales with h,
+		// arena is reallocated only if h does not fit
+		int n = max(this->h, this->max_h);
+		if (this->arena == nullptr || n > this->arena_h) {
+			this->alloc_arena(n);
+		}
+		n = this->arena_h;
 
-		this->p_est = new double[M::p_dim];
-		this->w = new double[this->h];
+		this->zero_arr();
 
-		this->s_arr = new double[M::s_dim*this->h+1]; // we are gonna use the last estimate as prior so h+1
-		this->o_arr = new double[M::o_dim*this->h];
-		this->u_arr = new double[M::u_dim*this->h];
+		this->delete_problem();
 
-		this->zero_arr();
-		
-		this->s.clear();
-		this->o.clear();
-		this->u.clear();
+		Problem::Options problem_options;
+		problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+		problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+		problem_options.enable_fast_removal = true;
+		this->problem = new Problem(problem_options);
 
-		for (int t = 0; t <= this->h; t++) {
-			this->s.push_back(this->s_arr + t*M::s_dim);
-			if (t == this-> h) break; // only s has h+1 size;
-			this->o.push_back(this->o_arr + t*M::o_dim);
-			this->u.push_back(this->u_arr + t*M::u_dim);
+		this->set_loss();
+
+		problem->AddParameterBlock(this->p_est, M::p_dim);
+		if (!this->fix_params) {
+			this->param_prior_cost = Prior_res<M::p_dim>::Create(this->p_prior.data(), this->C_p.data());
+			problem->AddResidualBlock(this->param_prior_cost, nullptr, this->p_est);
+			this->set_model_par_bounds();
 		}
 
-		this->set_loss();
+		for (int t = 0; t < n; t++) {
+			this->obs_cost.push_back(Obs_mhe_res<M>::Create(this->o_arr + t*M::o_dim, this->C_o.data(), &(this->w_o_arr[t])));
 
-		CostFunction *param_prior_cost_fun = Prior_res<M::p_dim>::Create(this->p_prior.data(), this->C_p.data());
-		problem->AddResidualBlock(param_prior_cost_fun, nullptr, this->p_est);
-		this->set_model_par_bounds();
+			if (t == 0) {
+				this->state_cost.push_back(State_mhe_prior_res<M>::Create(
+					this->s_arr, this->u_arr, &(this->dt_full_arr[0]), this->C_s.data(), &(this->w_arr[0])));
+			}
+			else {
+				this->state_cost.push_back(State_mhe_res<M>::Create(this->u_arr + t*M::u_dim, 
+					&(this->dt_full_arr[t]), this->C_s.data(), &(this->w_arr[t])));
+			}
+		}
 
-		for (int t = 0; t < this->h; t++) {
-			CostFunction *obs_cost_fun = Obs_mhe_res<M>::Create(this->o[t], this->C_o.data(), &(this->w[t]));
-			problem->AddResidualBlock(obs_cost_fun, this->obs_loss, this->s[t+1]); // we have h obs but h+1 states
+		for (int t = 1; t <= n; t++) {
+			problem->AddParameterBlock(this->s_arr + t*M::s_dim, M::s_dim);
+			problem->SetParameterBlockConstant(this->s_arr + t*M::s_dim);
 		}
 
-		CostFunction *state_prior_cost_fun = State_mhe_prior_res<M>::Create(
-			this->s[0], this->u[0], dt, this->C_s.data(), &(this->w[0]));
-		problem->AddResidualBlock(state_prior_cost_fun, this->state_loss, this->s[1], this->p_est);
+		if (this->fix_params) {
+			// parameters are estimated elsewhere, only the state window is solved
+			problem->SetParameterBlockConstant(this->p_est);
+		}
 
+		this->obs_id.assign(n, nullptr);
+		this->state_id.assign(n, nullptr);
+		this->active_k0 = n; // no terms in the problem yet
+		this->set_horizon(this->h);
+	}
 
-		for (int t = 1; t < this->h; t++) {
-			CostFunction *state_cost_fun = State_mhe_res<M>::Create(this->u[t], this->dt, this->C_s.data(), &(this->w[t]));
-			problem->AddResidualBlock(state_cost_fun, this->state_loss, this->s[t], this->s[t+1], this->p_est);
+	void set_horizon(int h_)
+	{
+		// no reallocation, terms of steps entering or leaving the window are added or removed,
+		// the state before the window is constant and acts as the prior
+		assert(h_ > 0 && h_ <= this->arena_h);
+		int k0 = this->arena_h - h_;
+
+		for (int t = min(k0, this->active_k0); t < max(k0, this->active_k0); t++) {
+			if (t >= k0) {
+				// obs t is of state t+1, we have h obs but h+1 states
+				this->obs_id[t] = this->problem->AddResidualBlock(this->obs_cost[t], this->obs_loss, 
+					this->s_arr + (t+1)*M::s_dim);
+
+				if (t == 0) {
+					this->state_id[t] = this->problem->AddResidualBlock(this->state_cost[t], this->state_loss, 
+						this->s_arr + M::s_dim, this->p_est);
+				}
+				else {
+					this->state_id[t] = this->problem->AddResidualBlock(this->state_cost[t], this->state_loss, 
+						this->s_arr + t*M::s_dim, this->s_arr + (t+1)*M::s_dim, this->p_est);
+				}
+			}
+			else {
+				this->problem->RemoveResidualBlock(this->obs_id[t]);
+				this->problem->RemoveResidualBlock(this->state_id[t]);
+				this->obs_id[t] = nullptr;
+				this->state_id[t] = nullptr;
+			}
+
+			if (t + 1 > k0)
+				this->problem->SetParameterBlockVariable(this->s_arr + (t+1)*M::s_dim);
+			else
+				this->problem->SetParameterBlockConstant(this->s_arr + (t+1)*M::s_dim);
 		}
 
+		this->active_k0 = k0;
+
+		this->h = h_;
+		this->w = this->w_arr + k0;
+		this->w_o = this->w_o_arr + k0;
+		this->dt_arr = this->dt_full_arr + k0;
 
+		this->s.clear();
+		this->o.clear();
+		this->u.clear();
+
+		for (int t = 0; t <= this->h; t++) {
+			this->s.push_back(this->s_arr + (k0 + t)*M::s_dim);
+			if (t == this-> h) break; // only s has h+1 size;
+			this->o.push_back(this->o_arr + (k0 + t)*M::o_dim);
+			this->u.push_back(this->u_arr + (k0 + t)*M::u_dim);
+		}
+	}
+
+	void set_params(const p_vec &p_)
+	{
+		memcpy(this->p_est, p_.data(), M::p_dim*sizeof(double));
 	}
 
 	void set_model_par_bounds()
@@ -235,11 +291,11 @@ public:
 	void set_loss()
 	{
 		if (this->obs_loss_s > 0) {
-			this->obs_loss = new LossFunctionWrapper(new HuberLoss(this->obs_loss_s), ceres::DO_NOT_TAKE_OWNERSHIP);
+			this->obs_loss = new LossFunctionWrapper(new HuberLoss(this->obs_loss_s), ceres::TAKE_OWNERSHIP);
 		}
 
 		if (this->state_loss_s > 0) {
-			this->state_loss = new LossFunctionWrapper(new HuberLoss(this->state_loss_s), ceres::DO_NOT_TAKE_OWNERSHIP);
+			this->state_loss = new LossFunctionWrapper(new HuberLoss(this->state_loss_s), ceres::TAKE_OWNERSHIP);
 		}
 	}
 
@@ -249,6 +305,85 @@ public:
 		if (this->solver_options.minimizer_progress_to_stdout) {
 			cout << this->solver_summary.BriefReport() << endl;
 		}
+
+		if (this->calc_cov) {
+			this->marginal_cov();
+		}
+	}
+
+	void marginal_cov()
+	{
+		// covariance of the last state and p from the gauss-newton information J^T J,
+		// the window is a chain s[1] ... s[h] with p shared, the states are eliminated
+		// in order so the cost is linear in h, it is recomputed from scratch every solve
+		const int n = this->h;
+		const int p_col = n*M::s_dim;
+
+		Problem::EvaluateOptions eval_options;
+		for (int t = 1; t <= n; t++)
+			eval_options.parameter_blocks.push_back(this->s[t]);
+		if (!this->fix_params)
+			eval_options.parameter_blocks.push_back(this->p_est);
+
+		CRSMatrix jac;
+		this->problem->Evaluate(eval_options, nullptr, nullptr, nullptr, &jac);
+
+		vector<s_mat> A(n, s_mat::Zero()); // diagonal blocks
+		vector<s_mat> C(n, s_mat::Zero()); // blocks of s[t], s[t+1]
+		vector<sp_mat> E(n, sp_mat::Zero()); // blocks of s[t], p
+		p_mat H_pp = p_mat::Zero();
+
+		for (int r = 0; r < jac.num_rows; r++) {
+			for (int a = jac.rows[r]; a < jac.rows[r+1]; a++) {
+				int ca = jac.cols[a];
+				for (int b = jac.rows[r]; b < jac.rows[r+1]; b++) {
+					int cb = jac.cols[b];
+					double v = jac.values[a]*jac.values[b];
+
+					if (ca >= p_col) {
+						if (cb >= p_col)
+							H_pp(ca - p_col, cb - p_col) += v;
+						continue;
+					}
+
+					int ka = ca/M::s_dim, kb = cb/M::s_dim;
+					if (cb >= p_col)
+						E[ka](ca % M::s_dim, cb - p_col) += v;
+					else if (kb == ka)
+						A[ka](ca % M::s_dim, cb % M::s_dim) += v;
+					else if (kb == ka + 1)
+						C[ka](ca % M::s_dim, cb % M::s_dim) += v;
+				}
+			}
+		}
+
+		for (int k = 0; k < n; k++)
+			A[k].diagonal().array() += 1e-9; // states of unfilled window have no information
+
+		for (int k = 0; k < n - 1; k++) {
+			Eigen::LDLT<s_mat> A_ldlt(A[k]);
+			s_mat AiC = A_ldlt.solve(C[k]);
+			sp_mat AiE = A_ldlt.solve(E[k]);
+
+			A[k+1] -= C[k].transpose()*AiC;
+			E[k+1] -= C[k].transpose()*AiE;
+			H_pp -= E[k].transpose()*AiE;
+		}
+
+		if (this->fix_params) {
+			this->s_cov = A[n-1].ldlt().solve(s_mat::Identity());
+			this->p_cov.setZero();
+			return;
+		}
+
+		Eigen::Matrix<double, M::s_dim + M::p_dim, M::s_dim + M::p_dim> H;
+		H << A[n-1], E[n-1], E[n-1].transpose(), H_pp;
+		
+		Eigen::Matrix<double, M::s_dim + M::p_dim, M::s_dim + M::p_dim> cov = 
+			H.ldlt().solve(decltype(H)::Identity());
+
+		this->s_cov = cov.template topLeftCorner<M::s_dim, M::s_dim>();
+		this->p_cov = cov.template bottomRightCorner<M::p_dim, M::p_dim>();
 	}
 
 	p_vec p_vector() { return array_to_vector<M::p_dim>(this->p_est); }
@@ -256,10 +391,35 @@ public:
 
 	void set_config(json config);
 
-	double dt;
+	double dt; // nominal time-step
 	int h; // horizon
-
-	double *w;
+	int max_h = 0; // arena is sized for at least this horizon
+	bool fix_params = false; // p_est is a constant block
+	// compute marginal covariance after each solve, off by default, every solve then
+	// evaluates the window Jacobian again and eliminates its h states, linear in h
+	// but about as costly as one more solver iteration, nothing is kept between solves
+	bool calc_cov = false;
+
+	s_mat s_cov; // covariance of the last state
+	p_mat p_cov;
+
+	double *w; // transition weights, zero for not yet filled samples
+	double *w_o; // observation weights, zero for missing observations
+	double *dt_arr; // time-step of each transition
+
+	double *arena = nullptr; // storage of all arrays
+	int arena_h = 0; // horizon the arena is sized for
+	double *w_arr = nullptr; // w, w_o and dt_arr of the whole arena
+	double *w_o_arr = nullptr;
+	double *dt_full_arr = nullptr;
+
+	// terms of every step of the arena, ids of the ones in the problem
+	vector<CostFunction *> obs_cost;
+	vector<CostFunction *> state_cost; // step 0 is the prior transition from s_arr
+	CostFunction *param_prior_cost = nullptr;
+	vector<ResidualBlockId> obs_id;
+	vector<ResidualBlockId> state_id;
+	int active_k0 = 0; // first step with terms in the problem
 	
 	o_vec C_o;
 	s_vec C_s;
@@ -299,6 +459,10 @@ void MHE_estimator<M>::set_config(json config)
 	this->dt = config["dt"];
 	this->h = config["h"];
 
+	if (!config["max_h"].is_null()) {
+		this->max_h = config["max_h"];
+	}
+
 	this->C_s = array_to_vector(config["C_s"]);
 	this->C_o = array_to_vector(config["C_o"]);
 	this->C_p = array_to_vector(config["C_prior"]);
@@ -332,6 +496,10 @@ void MHE_estimator<M>::set_config(json config)
 		this->obs_loss_s = config["obs_loss_s"];
 	}
 
+	if (!config["calc_cov"].is_null()) {
+		this->calc_cov = config["calc_cov"];
+	}
+
 	if (!config["state_loss_s"].is_null()) {
 		this->state_loss_s = config["state_loss_s"];
 	}
@@ -391,12 +559,21 @@ public:
 	typedef typename M::o_vec o_vec;
 	typedef typename M::p_vec p_vec;
 
+	typedef typename MHE_estimator<M>::s_mat s_mat;
+	typedef typename MHE_estimator<M>::p_mat p_mat;
+
 	struct request
 	{
 		int ts; // timestep
 		
 		vector<o_vec> o;
 		vector<u_vec> u;
+		vector<double> dt;
+		vector<bool> valid;
+
+		bool stamped = false; // samples have time stamps, ts is not the sample index
+		double stamp = -1; // time stamp of the last sample
+		int h = 0; // requested horizon, 0 keeps the current one
 
 		mutex mtx;
 		condition_variable cv;
@@ -409,6 +586,9 @@ public:
 		s_vec s;
 		p_vec p;
 
+		s_mat s_cov; // marginal covariance of s
+		p_mat p_cov;
+
 		mutex mtx;
 	};
 	
@@ -420,6 +600,7 @@ public:
 	~MHE_handler()
 	{
 		this->end();
+		delete this->kf;
 	}
 
 	void get_est(s_vec &s_, p_vec &p_, int t) 
@@ -435,26 +616,122 @@ public:
 		cerr << "mhe lag " << t-sol.ts - 1 << " ";
 	}
 
+	void get_est(s_vec &s_, p_vec &p_, s_mat &s_cov_, p_mat &p_cov_, int t)
+	{
+		unique_lock<mutex> sol_lck(this->sol.mtx);
+		if (t-sol.ts <= 0){
+			return;
+		}
+		s_ = this->sol.s;
+		p_ = this->sol.p;
+		s_cov_ = this->sol.s_cov;
+		p_cov_ = this->sol.p_cov;
+		sol_lck.unlock();
+
+		cerr << "mhe lag " << t-sol.ts - 1 << " ";
+	}
+
 	void post_request(const int ts, const o_vec &o_, const u_vec &u_)
 	{
+		this->post_request(ts, o_, u_, -1, true);
+	}
+
+	void post_request(const int ts, const o_vec &o_, const u_vec &u_, const double stamp, const bool valid=true)
+	{
+		// stamp is the measurement time in seconds, negative for nominal time-step
+		// valid is false for missing or occluded observation, o_ is then ignored
+		double dt_ = this->estim.dt;
+		u_vec u_s = u_;
+		if (stamp >= 0) {
+			if (this->last_stamp >= 0 && stamp <= this->last_stamp)
+				return; // repeated or out of order frame
+
+			if (this->last_stamp >= 0)
+				dt_ = stamp - this->last_stamp;
+			this->last_stamp = stamp;
+			this->last_stamp_ts = ts;
+
+			// inputs of the steps without a frame since the last sample, 
+			// every step is applied for the same time
+			if (this->n_pending > 0) {
+				u_s = (this->u_pending + u_)/(this->n_pending + 1);
+				this->u_pending.setZero();
+				this->n_pending = 0;
+			}
+		}
+
+		if (this->kf != nullptr) {
+			// filter is cheap, update directly
+			this->kf->post_request(ts, o_, u_s, dt_, valid);
+
+			unique_lock<mutex> sol_lck(this->sol.mtx);
+			this->sol.ts = ts;
+			this->kf->get_est(this->sol.s, this->sol.p, ts + 1);
+			this->kf->get_cov(this->sol.s_cov, this->sol.p_cov);
+			return;
+		}
+
 		unique_lock<mutex> rqst_lck(this->rqst.mtx);
 		// assert(ts == rqst.ts + 1 && this->sol.ts == -1);
 		this->rqst.ts = ts;
 
 		this->rqst.o.push_back(o_);
-		this->rqst.u.push_back(u_);
+		this->rqst.u.push_back(u_s);
+		this->rqst.dt.push_back(dt_);
+		this->rqst.valid.push_back(valid);
+		this->rqst.stamped = stamp >= 0;
 		
 		this->rqst.cv.notify_one();
 	}
 
+	void post_input(const int ts, const u_vec &u_)
+	{
+		// stamped mode, called every step after its frames, if none was accepted
+		// the input is averaged into the input of the next frame
+		if (this->last_stamp_ts == ts)
+			return;
+
+		this->u_pending += u_;
+		this->n_pending += 1;
+	}
+
+	void set_horizon(int h_)
+	{
+		// applied by the handler thread before the next solve
+		if (this->kf != nullptr)
+			return;
+
+		unique_lock<mutex> rqst_lck(this->rqst.mtx);
+		if (h_ > this->estim.arena_h) {
+			cerr << "MHE horizon " << h_ << " exceeds max_h " << this->estim.arena_h << endl;
+			h_ = this->estim.arena_h;
+		}
+		this->rqst.h = h_;
+	}
+
 	void start();
 
 	void end()
 	{
 		if (this->done == false) {
+			// set under the request locks, a handler checking done before its wait
+			// can not miss the notification
+			unique_lock<mutex> rqst_lck(this->rqst.mtx);
+			unique_lock<mutex> param_rqst_lck(this->param_rqst.mtx);
 			this->done = true;
+			param_rqst_lck.unlock();
+			rqst_lck.unlock();
+
+			if (this->kf != nullptr)
+				return;
+
 			this->rqst.cv.notify_one();
 			this->hndl_thread.join();
+
+			if (this->split_params) {
+				this->param_rqst.cv.notify_one();
+				this->param_thread.join();
+			}
 		}
 	}
 
@@ -464,11 +741,54 @@ public:
 		unique_lock<mutex> rqst_lck(this->rqst.mtx);
 		this->sol.ts = -1;
 		this->sol.s.setZero();
-		this->estim.zero_arr();
+		this->sol.s_cov.setZero();
+		this->sol.p_cov.setZero();
 		
 		this->rqst.ts = -1;
 		this->rqst.o.clear();
 		this->rqst.u.clear();
+		this->rqst.dt.clear();
+		this->rqst.valid.clear();
+
+		this->last_stamp = -1;
+		this->last_stamp_ts = -1;
+		this->u_pending.setZero();
+		this->n_pending = 0;
+
+		if (this->kf != nullptr) {
+			this->kf->reset(this->estim.p_prior);
+			return;
+		}
+
+		this->estim.zero_arr();
+
+		if (this->split_params) {
+			unique_lock<mutex> param_sol_lck(this->param_sol.mtx);
+			unique_lock<mutex> param_rqst_lck(this->param_rqst.mtx);
+			this->param_estim.zero_arr();
+			this->param_estim.set_params(this->estim.p_prior);
+			this->estim.set_params(this->estim.p_prior);
+
+			this->param_sol.ts = -1;
+			this->param_sol.p = this->estim.p_prior;
+			this->param_sol.p_cov.setZero();
+
+			this->param_rqst.ts = -1;
+			this->param_rqst.o.clear();
+			this->param_rqst.u.clear();
+			this->param_rqst.dt.clear();
+			this->param_rqst.valid.clear();
+		}
+	}
+
+	void build_problem()
+	{
+		if (this->kf != nullptr)
+			return;
+
+		this->estim.build_problem();
+		if (this->split_params)
+			this->param_estim.build_problem();
 	}
 
 	void set_config(json config);
@@ -482,8 +802,26 @@ public:
 	thread hndl_thread;
 
 	bool shift_p_prior = false;
+	double last_stamp = -1;
+	int last_stamp_ts = -1; // step of the last accepted frame
+	u_vec u_pending = u_vec::Zero(); // sum of the inputs of steps without a frame
+	int n_pending = 0;
 
 	MHE_estimator<M> estim;
+
+	// multi-rate mode, estim solves only states with fixed p, 
+	// param_estim re-estimates p over a longer window every param_rate steps
+	bool split_params = false;
+	int param_rate = 25;
+
+	solution param_sol;
+	request param_rqst;
+	thread param_thread;
+
+	MHE_estimator<M> param_estim;
+
+	// alternative filter backend, nullptr for mhe
+	KF_estimator<M> *kf = nullptr;
 };
 
 
@@ -494,8 +832,6 @@ void mhe_handler_func(MHE_handler<M> * hndl)
 	cerr << "starting mhe handler thread" << endl;
 
 	int ts, time_shift;
-	double *s_next, *s, *u, *p;
-	typename M::s_vec ds;
 	while (!hndl->done)
 	{
 		unique_lock<mutex> rqst_lck(hndl->rqst.mtx);
@@ -507,36 +843,41 @@ void mhe_handler_func(MHE_handler<M> * hndl)
 			break;
 		}
 
-		assert(hndl->rqst.o.size() == hndl->rqst.u.size());
+		assert(hndl->rqst.o.size() == hndl->rqst.u.size() && hndl->rqst.o.size() == hndl->rqst.dt.size());
 		time_shift = hndl->rqst.ts - hndl->sol.ts;
-		if (time_shift != hndl->rqst.o.size()) {
+		if (!hndl->rqst.stamped && time_shift != hndl->rqst.o.size()) {
 			hndl->rqst.o.clear();
 			hndl->rqst.u.clear();
+			hndl->rqst.dt.clear();
+			hndl->rqst.valid.clear();
 			hndl->sol.ts = hndl->rqst.ts;
 			rqst_lck.unlock();
 			continue;
 		}
-		
-		hndl->estim.shift_arr(time_shift);
-
-		
-
-		for (int t = 0; t < time_shift; t++) {
-			hndl->estim.w[hndl->h - time_shift + t] = 1;
-			memcpy(hndl->estim.o[hndl->h - time_shift + t], hndl->rqst.o[t].data(), M::o_dim*sizeof(double));
-			memcpy(hndl->estim.u[hndl->h - time_shift + t], hndl->rqst.u[t].data(), M::u_dim*sizeof(double));
-
-			s = hndl->estim.s[hndl->h - time_shift + t];
-			s_next = hndl->estim.s[hndl->h - time_shift + t + 1];
-			u = hndl->estim.u[hndl->h - time_shift + t];
-			p = hndl->estim.p_prior.data();
 
-			M::state_eq(ds.data(), s, u, p);
-
-			for (int i = 0; i < M::s_dim; i++) {
-				s_next[i] = s[i] + hndl->estim.dt*ds[i];
-			}
+		if (hndl->rqst.h > 0 && hndl->rqst.h != hndl->estim.h) {
+			hndl->estim.set_horizon(hndl->rqst.h);
+			hndl->h = hndl->rqst.h;
+		}
 
+		if (hndl->split_params) {
+			unique_lock<mutex> param_sol_lck(hndl->param_sol.mtx);
+			hndl->estim.set_params(hndl->param_sol.p);
+			param_sol_lck.unlock();
+
+			hndl->estim.push_samples(hndl->rqst.o, hndl->rqst.u, hndl->rqst.dt, hndl->rqst.valid, hndl->estim.p_est);
+
+			unique_lock<mutex> param_rqst_lck(hndl->param_rqst.mtx);
+			hndl->param_rqst.ts = hndl->rqst.ts;
+			hndl->param_rqst.o.insert(hndl->param_rqst.o.end(), hndl->rqst.o.begin(), hndl->rqst.o.end());
+			hndl->param_rqst.u.insert(hndl->param_rqst.u.end(), hndl->rqst.u.begin(), hndl->rqst.u.end());
+			hndl->param_rqst.dt.insert(hndl->param_rqst.dt.end(), hndl->rqst.dt.begin(), hndl->rqst.dt.end());
+			hndl->param_rqst.valid.insert(hndl->param_rqst.valid.end(), hndl->rqst.valid.begin(), hndl->rqst.valid.end());
+			hndl->param_rqst.cv.notify_one();
+			param_rqst_lck.unlock();
+		}
+		else {
+			hndl->estim.push_samples(hndl->rqst.o, hndl->rqst.u, hndl->rqst.dt, hndl->rqst.valid, hndl->estim.p_prior.data());
 		}
 
 		if (hndl->shift_p_prior)
@@ -546,6 +887,8 @@ void mhe_handler_func(MHE_handler<M> * hndl)
 
 		hndl->rqst.o.clear();
 		hndl->rqst.u.clear();
+		hndl->rqst.dt.clear();
+		hndl->rqst.valid.clear();
 
 		rqst_lck.unlock();
 
@@ -559,6 +902,12 @@ void mhe_handler_func(MHE_handler<M> * hndl)
 		hndl->sol.ts = ts;
 		hndl->sol.p = hndl->estim.p_vector();
 		hndl->sol.s = hndl->estim.s_vector();
+		hndl->sol.s_cov = hndl->estim.s_cov;
+		hndl->sol.p_cov = hndl->estim.p_cov;
+		if (hndl->split_params) {
+			unique_lock<mutex> param_sol_lck(hndl->param_sol.mtx);
+			hndl->sol.p_cov = hndl->param_sol.p_cov;
+		}
 		sol_lck.unlock();
 
 		// auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
@@ -569,12 +918,64 @@ void mhe_handler_func(MHE_handler<M> * hndl)
 	cerr << "ending mhe handler thread" << endl;
 }
 
+template<typename M>
+void mhe_param_func(MHE_handler<M> * hndl)
+{
+	cerr << "starting mhe param thread" << endl;
+
+	int ts;
+	while (!hndl->done)
+	{
+		unique_lock<mutex> rqst_lck(hndl->param_rqst.mtx);
+		if (hndl->param_rqst.o.size() < hndl->param_rate && !hndl->done) {
+			hndl->param_rqst.cv.wait(rqst_lck);
+		}
+		if (hndl->done) {
+			rqst_lck.unlock();
+			break;
+		}
+		if (hndl->param_rqst.o.size() < hndl->param_rate) {
+			rqst_lck.unlock();
+			continue;
+		}
+
+		assert(hndl->param_rqst.o.size() == hndl->param_rqst.u.size());
+		hndl->param_estim.push_samples(hndl->param_rqst.o, hndl->param_rqst.u, hndl->param_rqst.dt, 
+			hndl->param_rqst.valid, hndl->param_estim.p_est);
+
+		ts = hndl->param_rqst.ts;
+
+		hndl->param_rqst.o.clear();
+		hndl->param_rqst.u.clear();
+		hndl->param_rqst.dt.clear();
+		hndl->param_rqst.valid.clear();
+
+		rqst_lck.unlock();
+
+		hndl->param_estim.solve_problem();
+
+		unique_lock<mutex> sol_lck(hndl->param_sol.mtx);
+		hndl->param_sol.ts = ts;
+		hndl->param_sol.p = hndl->param_estim.p_vector();
+		hndl->param_sol.p_cov = hndl->param_estim.p_cov;
+		sol_lck.unlock();
+	}
+
+	cerr << "ending mhe param thread" << endl;
+}
+
 template<typename M>
 void MHE_handler<M>::start()
 {	
 	this->reset();
 	this->done = false;
+	if (this->kf != nullptr)
+		return;
+
 	this->hndl_thread = thread(mhe_handler_func<M>, this);
+
+	if (this->split_params)
+		this->param_thread = thread(mhe_param_func<M>, this);
 }
 
 template<typename M>
@@ -583,7 +984,56 @@ void MHE_handler<M>::set_config(json config)
 	this->estim.set_config(config);
 	this->h = config["h"];
 
+	if (!config["estimator"].is_null()) {
+		delete this->kf;
+		this->kf = nullptr;
+
+		if (string(config["estimator"]).compare("ekf") == 0) {
+			EKF_estimator<M> *ekf = new EKF_estimator<M>;
+			ekf->set_config(config);
+			this->kf = ekf;
+			cerr << "MHE using ekf" << endl;
+		}
+		else if (string(config["estimator"]).compare("ukf") == 0) {
+			UKF_estimator<M> *ukf = new UKF_estimator<M>;
+			ukf->set_config(config);
+			this->kf = ukf;
+			cerr << "MHE using ukf" << endl;
+		}
+		else if (string(config["estimator"]).compare("isam") == 0) {
+			ISAM_estimator<M> *isam = new ISAM_estimator<M>;
+			isam->set_config(config);
+			this->kf = isam;
+			cerr << "MHE using isam" << endl;
+		}
+	}
+
 	if (!config["shift_p_prior"].is_null()) {
 		this->shift_p_prior = config["shift_p_prior"];
 	}
-}
\ No newline at end of file
+
+	if (!config["split_params"].is_null()) {
+		this->split_params = config["split_params"];
+	}
+
+	if (this->split_params) {
+		json param_config = config;
+		if (!config["param_h"].is_null()) {
+			param_config["h"] = config["param_h"];
+		}
+
+		if (!config["param_rate"].is_null()) {
+			this->param_rate = config["param_rate"];
+		}
+
+		if (!config["param_solver_max_time"].is_null()) {
+			param_config["solver_max_time"] = config["param_solver_max_time"];
+		}
+
+		this->estim.fix_params = true;
+		this->param_estim.set_config(param_config);
+		cerr << "MHE params re-estimated every " << this->param_rate << " steps, horizon " << this->param_estim.h << endl;
+	}
+}
+
+#endif
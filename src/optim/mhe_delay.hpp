@@ -0,0 +1,317 @@
+#ifndef __MHE_DELAY_HPP__
+#define __MHE_DELAY_HPP__
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <eigen3/Eigen/Dense>
+
+#include "optim/mhe.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+template<typename M>
+class MHE_delay_handler
+{
+/* multi-hypothesis MHE for input delay estimation,
+ * each candidate delay has its own estimator and thread,
+ * observations and undelayed inputs are shared in one ring buffer,
+ * the estimate of the hypothesis with the lowest window cost is used
+ */
+public:
+	typedef typename M::s_vec s_vec;
+	typedef typename M::u_vec u_vec;
+	typedef typename M::o_vec o_vec;
+	typedef typename M::p_vec p_vec;
+
+	typedef typename MHE_estimator<M>::s_mat s_mat;
+	typedef typename MHE_estimator<M>::p_mat p_mat;
+
+	struct hypothesis
+	{
+		int u_delay;
+		MHE_estimator<M> estim;
+
+		int ts = -1; // last solved timestep
+		double cost = INFINITY; // smoothed window cost
+
+		s_vec s;
+		p_vec p;
+
+		s_mat s_cov;
+		p_mat p_cov;
+
+		thread hndl_thread;
+	};
+
+	struct buffer
+	{
+		int ts = -1; // last posted timestep
+
+		vector<o_vec> o;
+		vector<u_vec> u;
+		vector<bool> valid;
+
+		mutex mtx;
+		condition_variable cv;
+	};
+
+	MHE_delay_handler() {}
+
+	~MHE_delay_handler()
+	{
+		this->end();
+
+		for (auto hyp : this->hyps)
+			delete hyp;
+	}
+
+	void post_request(const int ts, const o_vec &o_, const u_vec &u_, const bool valid=true)
+	{
+		// u_ is the input applied at ts, without delay
+		unique_lock<mutex> buf_lck(this->buf.mtx);
+		int idx = ts % this->buf_len;
+
+		this->buf.ts = ts;
+		this->buf.o[idx] = o_;
+		this->buf.u[idx] = u_;
+		this->buf.valid[idx] = valid;
+
+		this->buf.cv.notify_all();
+	}
+
+	void get_est(s_vec &s_, p_vec &p_, int t)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		hypothesis *hyp = this->best();
+		if (hyp == nullptr || t - hyp->ts <= 0) {
+			return;
+		}
+
+		s_ = hyp->s;
+		p_ = hyp->p;
+	}
+
+	void get_est(s_vec &s_, p_vec &p_, s_mat &s_cov_, p_mat &p_cov_, int t)
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		hypothesis *hyp = this->best();
+		if (hyp == nullptr || t - hyp->ts <= 0) {
+			return;
+		}
+
+		s_ = hyp->s;
+		p_ = hyp->p;
+		s_cov_ = hyp->s_cov;
+		p_cov_ = hyp->p_cov;
+	}
+
+	int get_delay()
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		hypothesis *hyp = this->best();
+		if (hyp == nullptr) {
+			return this->u_delay;
+		}
+
+		return hyp->u_delay;
+	}
+
+	Eigen::VectorXd get_costs()
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		Eigen::VectorXd costs(this->hyps.size());
+		for (int k = 0; k < this->hyps.size(); k++) {
+			costs[k] = this->hyps[k]->cost;
+		}
+
+		return costs;
+	}
+
+	void build_problem()
+	{
+		for (auto hyp : this->hyps)
+			hyp->estim.build_problem();
+	}
+
+	void start();
+
+	void end()
+	{
+		if (this->done == false) {
+			this->done = true;
+			this->buf.cv.notify_all();
+			for (auto hyp : this->hyps)
+				hyp->hndl_thread.join();
+		}
+	}
+
+	void reset()
+	{
+		unique_lock<mutex> sol_lck(this->sol_mtx);
+		unique_lock<mutex> buf_lck(this->buf.mtx);
+
+		this->buf.ts = -1;
+		this->buf.o.assign(this->buf_len, o_vec::Zero());
+		this->buf.u.assign(this->buf_len, u_vec::Zero());
+		this->buf.valid.assign(this->buf_len, false);
+
+		for (auto hyp : this->hyps) {
+			hyp->ts = -1;
+			hyp->cost = INFINITY;
+			hyp->s.setZero();
+			hyp->p = hyp->estim.p_prior;
+			hyp->s_cov.setZero();
+			hyp->p_cov.setZero();
+			hyp->estim.zero_arr();
+		}
+	}
+
+	void set_config(json config);
+
+	hypothesis *best()
+	{
+		// call with sol_mtx locked
+		hypothesis *result = nullptr;
+		for (auto hyp : this->hyps) {
+			if (hyp->ts < 0)
+				continue;
+
+			if (result == nullptr || hyp->cost < result->cost)
+				result = hyp;
+		}
+
+		return result;
+	}
+
+	int h;
+	int u_delay = 0; // default delay before any hypothesis is solved
+	int buf_len;
+	double cost_smoothing = 0.9;
+
+	buffer buf;
+	vector<hypothesis *> hyps;
+
+	mutex sol_mtx;
+	atomic<bool> done = true;
+};
+
+template<typename M>
+void mhe_delay_func(MHE_delay_handler<M> *hndl, typename MHE_delay_handler<M>::hypothesis *hyp)
+{
+	cerr << "starting mhe delay " << hyp->u_delay << " thread" << endl;
+
+	vector<typename M::o_vec> o;
+	vector<typename M::u_vec> u;
+	vector<double> dt;
+	vector<bool> valid;
+
+	int ts, t0;
+	while (!hndl->done)
+	{
+		unique_lock<mutex> buf_lck(hndl->buf.mtx);
+		if (hndl->buf.ts <= hyp->ts && !hndl->done) {
+			hndl->buf.cv.wait(buf_lck);
+		}
+		if (hndl->done) {
+			buf_lck.unlock();
+			break;
+		}
+		if (hndl->buf.ts <= hyp->ts) {
+			buf_lck.unlock();
+			continue;
+		}
+
+		ts = hndl->buf.ts;
+		t0 = max(hyp->ts + 1, ts - hndl->h + 1); // older samples would be shifted out anyway
+
+		o.clear();
+		u.clear();
+		dt.clear();
+		valid.clear();
+
+		for (int t = t0; t <= ts; t++) {
+			int t_u = t - hyp->u_delay;
+
+			o.push_back(hndl->buf.o[t % hndl->buf_len]);
+			valid.push_back(hndl->buf.valid[t % hndl->buf_len]);
+			dt.push_back(hyp->estim.dt);
+
+			if (t_u >= 0)
+				u.push_back(hndl->buf.u[t_u % hndl->buf_len]);
+			else
+				u.push_back(M::u_vec::Zero());
+		}
+
+		buf_lck.unlock();
+
+		hyp->estim.push_samples(o, u, dt, valid, hyp->estim.p_prior.data());
+		hyp->estim.solve_problem();
+
+		unique_lock<mutex> sol_lck(hndl->sol_mtx);
+		if (hyp->ts < 0) {
+			hyp->cost = hyp->estim.solver_summary.final_cost;
+		}
+		else {
+			hyp->cost = hndl->cost_smoothing*hyp->cost +
+				(1 - hndl->cost_smoothing)*hyp->estim.solver_summary.final_cost;
+		}
+
+		hyp->ts = ts;
+		hyp->s = hyp->estim.s_vector();
+		hyp->p = hyp->estim.p_vector();
+		hyp->s_cov = hyp->estim.s_cov;
+		hyp->p_cov = hyp->estim.p_cov;
+		sol_lck.unlock();
+	}
+
+	cerr << "ending mhe delay " << hyp->u_delay << " thread" << endl;
+}
+
+template<typename M>
+void MHE_delay_handler<M>::start()
+{
+	this->reset();
+	this->done = false;
+
+	for (auto hyp : this->hyps)
+		hyp->hndl_thread = thread(mhe_delay_func<M>, this, hyp);
+}
+
+template<typename M>
+void MHE_delay_handler<M>::set_config(json config)
+{
+	this->h = config["h"];
+
+	if (!config["u_delay"].is_null()) {
+		this->u_delay = config["u_delay"];
+	}
+
+	if (!config["delay_cost_smoothing"].is_null()) {
+		this->cost_smoothing = config["delay_cost_smoothing"];
+	}
+
+	for (auto hyp : this->hyps)
+		delete hyp;
+	this->hyps.clear();
+
+	int max_delay = 0;
+	for (int d : config["u_delays"]) {
+		hypothesis *hyp = new hypothesis;
+		hyp->u_delay = d;
+		hyp->estim.set_config(config);
+		this->hyps.push_back(hyp);
+
+		max_delay = max(max_delay, d);
+	}
+
+	this->buf_len = max_delay + 2*this->h;
+
+	cerr << "MHE delay estimation with " << this->hyps.size() << " hypotheses" << endl;
+}
+
+#endif
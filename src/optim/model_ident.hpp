@@ -1,8 +1,20 @@
+#include <vector>
+#include <map>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+
 #include <eigen3/Eigen/Dense>
 #include <ceres/ceres.h>
 
 #include "utils/aux.hpp"
+#include "utils/parser.hpp"
 #include "model/drone_model.hpp"
+#include "optim/residuals.hpp"
 
 // using AutoDiffCostFunction;
 // using CostFunction;
@@ -12,6 +24,42 @@
 
 using namespace  ceres;
 
+// observations and inputs stay in the trajectory matrices, not in the parameter blocks,
+// one cost function per trajectory and term holds them, the residual of sample t
+// passes t as a constant block of size one, the index blocks are shared by all trajectories
+
+inline int sample_index(const double t)
+{
+	return (int)t;
+}
+
+template<typename T, int N>
+inline int sample_index(const Jet<T, N> &t)
+{
+	return (int)t.a;
+}
+
+template<typename M>
+struct Traj_input
+{
+	Traj_input(const double *u, const double *u_0, const int u_delay, const bool u_delay_shift) :
+		u(u), u_0(u_0), u_delay(u_delay), u_shift(u_delay_shift ? u_delay : 0) {}
+
+	const double *row(const int t) const
+	{
+		// as Model_ident::delayed_input
+		if (t < this->u_delay)
+			return this->u_0;
+
+		return this->u + (t - this->u_shift)*M::u_dim;
+	}
+
+	const double *u; // inputs of the trajectory, row-major
+	const double *u_0;
+	const int u_delay;
+	const int u_shift;
+};
+
 template<typename M>
 struct Obs_res
 {
@@ -19,38 +67,43 @@ struct Obs_res
 		obs(obs), C(C) {}
 	
 	template <typename T>
-	bool operator()(const T* const s, T* residual) const 
+	bool operator()(const T* const s, const T* const idx, T* residual) const 
 	{
+		int t = sample_index(idx[0]);
+
 		T o[M::o_dim];
 		M::output_eq(o, s);
 
+		const double *obs_t = this->obs + t*M::o_dim;
 		for (int i = 0; i < M::o_dim; i++) {
-			residual[i] = this->C[i]*(o[i] - this->obs[i]);
+			residual[i] = this->C[i]*(o[i] - obs_t[i]);
 		}
 
 		return true;
 	}
 
 	static CostFunction* Create(const double *obs, const double *C) {
-		return (new AutoDiffCostFunction<Obs_res, M::o_dim, M::s_dim>(new Obs_res(obs, C)));
+		return (new AutoDiffCostFunction<Obs_res, M::o_dim, M::s_dim, 1>(new Obs_res(obs, C)));
 	}
 
-	const double *obs;
+	const double *obs; // observations of the trajectory, row-major
 	const double *C; // cost multipliers
 };
 
 template<typename M>
 struct State_res
 {
-	State_res(const double *u, const double dt, const double *C) :
+	State_res(const Traj_input<M> &u, const double dt, const double *C) :
 		u(u), dt(dt), C(C) {}
 	
 	template <typename T>
 	bool operator()(const T* const s_curr, const T* const s_next,
-		const T* const p, T* res) const
+		const T* const p, const T* const idx, T* res) const
 	{
+		int t = sample_index(idx[0]);
+
 		T ds[M::s_dim];
-		M::state_eq(ds, s_curr, this->u, p);
+		M::state_eq(ds, s_curr, this->u.row(t), p);
 
 		for(int i = 0; i < M::s_dim; i++) {
 			res[i] = this->C[i]*((s_curr[i] - s_next[i])/this->dt + ds[i]);
@@ -60,67 +113,141 @@ struct State_res
 	}
 
 
-	static CostFunction* Create(const double* u, const double dt, const double *C) {
-		return (new AutoDiffCostFunction<State_res, M::s_dim, M::s_dim, M::s_dim, M::p_dim>(new State_res(u, dt, C)));
+	static CostFunction* Create(const Traj_input<M> &u, const double dt, const double *C) {
+		return (new AutoDiffCostFunction<State_res, M::s_dim, M::s_dim, M::s_dim, M::p_dim, 1>(
+			new State_res(u, dt, C)));
 	}
 
-	const double *u;
+	const Traj_input<M> u;
 	const double dt;
 	const double *C; // cost multiplier
 };
 
-template<int S>
-struct Diff_res
+inline void bspline_basis(const double u, double *w)
 {
-	Diff_res(const double *C) :
-		C(C) {}
+	// uniform cubic b-spline weights of the four control points of a segment, u in [0, 1]
+	w[0] = (1 - u)*(1 - u)*(1 - u)/6;
+	w[1] = (3*u*u*u - 6*u*u + 4)/6;
+	w[2] = (-3*u*u*u + 3*u*u + 3*u + 1)/6;
+	w[3] = u*u*u/6;
+}
+
+template<typename M>
+struct Spline_obs_res
+{
+	// state is a combination of four spline control points,
+	// w holds the weights of every position in a segment, four per position
+	Spline_obs_res(const double *obs, const double *w, const int spacing, const double *C) :
+		obs(obs), w(w), spacing(spacing), C(C) {}
 	
 	template <typename T>
-	bool operator()(const T* a, const T* b, T* res) const
+	bool operator()(const T* const c0, const T* const c1, 
+		const T* const c2, const T* const c3, const T* const idx, T* residual) const 
 	{
-		for(int i = 0; i < S; i++) {
-			res[i] = this->C[i]*(a[i] - b[i]);
+		int t = sample_index(idx[0]);
+		const double *w = this->w + 4*(t % this->spacing);
+
+		T s[M::s_dim];
+		T o[M::o_dim];
+		for (int i = 0; i < M::s_dim; i++)
+			s[i] = w[0]*c0[i] + w[1]*c1[i] + w[2]*c2[i] + w[3]*c3[i];
+
+		M::output_eq(o, s);
+
+		const double *obs_t = this->obs + t*M::o_dim;
+		for (int i = 0; i < M::o_dim; i++) {
+			residual[i] = this->C[i]*(o[i] - obs_t[i]);
 		}
 
 		return true;
 	}
 
-
-	static CostFunction* Create(const double *C) {
-		return (new AutoDiffCostFunction<Diff_res, S, S, S>(new Diff_res(C)));
+	static CostFunction* Create(const double *obs, const double *w, const int spacing, const double *C) {
+		return (new AutoDiffCostFunction<Spline_obs_res, M::o_dim, M::s_dim, M::s_dim, M::s_dim, M::s_dim, 1>(
+			new Spline_obs_res(obs, w, spacing, C)));
 	}
 
-	const double *C; // cost multiplier
+	const double *obs; // observations of the trajectory, row-major
+	const double *w; // basis weights
+	const int spacing;
+	const double *C; // cost multipliers
 };
 
+template<typename M>
+struct Spline_state_res
+{
+	// State_res with both states combined from the same four control points,
+	// t + 1 is evaluated in the segment of t, at most at its end
+	Spline_state_res(const Traj_input<M> &u, const double dt, const double *w, const int spacing, const double *C) :
+		u(u), dt(dt), w(w), spacing(spacing), C(C) {}
+	
+	template <typename T>
+	bool operator()(const T* const c0, const T* const c1, const T* const c2, 
+		const T* const c3, const T* const p, const T* const idx, T* res) const
+	{
+		int t = sample_index(idx[0]);
+		const double *w_curr = this->w + 4*(t % this->spacing);
+		const double *w_next = w_curr + 4;
+
+		T s_curr[M::s_dim];
+		T s_next[M::s_dim];
+		T ds[M::s_dim];
+		for (int i = 0; i < M::s_dim; i++) {
+			s_curr[i] = w_curr[0]*c0[i] + w_curr[1]*c1[i] + w_curr[2]*c2[i] + w_curr[3]*c3[i];
+			s_next[i] = w_next[0]*c0[i] + w_next[1]*c1[i] + w_next[2]*c2[i] + w_next[3]*c3[i];
+		}
+
+		M::state_eq(ds, s_curr, this->u.row(t), p);
 
+		for(int i = 0; i < M::s_dim; i++) {
+			res[i] = this->C[i]*((s_curr[i] - s_next[i])/this->dt + ds[i]);
+		}
+
+		return true;
+	}
+
+	static CostFunction* Create(const Traj_input<M> &u, const double dt, 
+		const double *w, const int spacing, const double *C) 
+	{
+		return (new AutoDiffCostFunction<Spline_state_res, M::s_dim, 
+			M::s_dim, M::s_dim, M::s_dim, M::s_dim, M::p_dim, 1>(
+			new Spline_state_res(u, dt, w, spacing, C)));
+	}
+
+	const Traj_input<M> u;
+	const double dt;
+	const double *w; // basis weights
+	const int spacing;
+	const double *C; // cost multiplier
+};
 
 template<int S>
-struct Prior_res
+struct Diff_res
 {
-	Prior_res(const double *x_p, const double *C) :
-		x_p(x_p), C(C) {}
+	Diff_res(const double *C) :
+		C(C) {}
 	
 	template <typename T>
-	bool operator()(const T* const x, T* residual) const
+	bool operator()(const T* a, const T* b, T* res) const
 	{
-		
-		for (int i = 0; i < S; i++)
-			residual[i] = C[i]*(x[i] - this->x_p[i]);
+		for(int i = 0; i < S; i++) {
+			res[i] = this->C[i]*(a[i] - b[i]);
+		}
 
 		return true;
 	}
 
-	static CostFunction* Create(const double *x_p, const double *C)
-	{
-		return (new AutoDiffCostFunction<Prior_res<S>, S, S>(new Prior_res<S>(x_p, C)));
+
+	static CostFunction* Create(const double *C) {
+		return (new AutoDiffCostFunction<Diff_res, S, S, S>(new Diff_res(C)));
 	}
 
-	const double *x_p;
 	const double *C; // cost multiplier
 };
 
 
+
+
 template<typename M>
 class Model_ident {
 public:
@@ -134,6 +261,7 @@ public:
 	typedef Eigen::Matrix<double, -1, M::o_dim, Eigen::RowMajor> o_mat;
 	typedef Eigen::Matrix<double, -1, M::u_dim, Eigen::RowMajor> u_mat;
 	typedef Eigen::Matrix<double, -1, M::p_dim, Eigen::RowMajor> p_mat;
+	typedef Eigen::Matrix<double, M::p_dim, M::p_dim, Eigen::RowMajor> p_cov_mat;
 
 	Model_ident()
 	{
@@ -153,6 +281,8 @@ public:
 
 		this->C_shift_diff.setZero();
 		this->C_shift_global.setZero();
+
+		this->smooth_acc_sd.setOnes();
 	}
 
 	~Model_ident()
@@ -160,7 +290,7 @@ public:
 		
 		this->clear_trajectories();
 
-		delete this->problem;
+		this->delete_problem();
 	}
 
 	void set_config(json config);
@@ -170,44 +300,180 @@ public:
 		assert(k < this->state_est.size());
 		assert(t < this->state_est[k]->rows());
 	
-		double *o = this->pos_data[k]->row(t).data();
 		double *s = this->state_est[k]->row(t).data();
+		double *idx = &this->sample_idx[t];
 
-		CostFunction *cost_fun = Obs_res<M>::Create(o, this->C_o.data());		
-		this->problem->AddResidualBlock(cost_fun, this->obs_loss, s);
+		if (this->spline_spacing > 1) {
+			int i = t/this->spline_spacing;
+
+			this->problem->AddResidualBlock(this->obs_cost[k], this->obs_loss, 
+				this->ctrl_est[k]->row(i).data(), this->ctrl_est[k]->row(i+1).data(),
+				this->ctrl_est[k]->row(i+2).data(), this->ctrl_est[k]->row(i+3).data(), idx);
+			return;
+		}
+
+		this->problem->AddResidualBlock(this->obs_cost[k], this->obs_loss, s, idx);
 	}
 
-	void add_state(int k, int t, int u_delay)
+	void add_state(int k, int t)
 	{
 		assert(k < this->state_est.size());
 		assert(t < this->state_est[k]->rows() - 1);
 
 		double *s = this->state_est[k]->row(t).data();
 		double *s_next = this->state_est[k]->row(t+1).data();
-		double *u;
-		if (t >= u_delay)
-			u = this->input_data[k]->row(t).data();
-		else
-			u = this->u_0.data();
 
 		double *p = this->param_est.data();
 		if (this->use_param_shift)
-			p = this->param_shift_est[k]->row(t).data();
+			p = this->param_shift_est[k]->row(t/this->param_shift_segment).data();
+
+		double *idx = &this->sample_idx[t];
+
+		if (this->spline_spacing > 1) {
+			int i = t/this->spline_spacing;
+
+			this->problem->AddResidualBlock(this->state_cost[k], this->state_loss, 
+				this->ctrl_est[k]->row(i).data(), this->ctrl_est[k]->row(i+1).data(),
+				this->ctrl_est[k]->row(i+2).data(), this->ctrl_est[k]->row(i+3).data(), p, idx);
+			return;
+		}
+
+		this->problem->AddResidualBlock(this->state_cost[k], this->state_loss, s, s_next, p, idx);
+	}
+
+	double *delayed_input(int k, int t, int u_delay)
+	{
+		// input of the transition from t, zero for the first u_delay steps,
+		// with u_delay_shift the input u_delay steps earlier, else the input at t
+		if (t < u_delay)
+			return this->u_0.data();
+
+		return this->input_data[k]->row(this->u_delay_shift ? t - u_delay : t).data();
+	}
+
+	void create_costs(int u_delay)
+	{
+		// obs and state cost functions of every trajectory and the shared parameter shift costs,
+		// owned by this instance
+		this->shift_global_cost = Diff_res<M::p_dim>::Create(this->C_shift_global.data());
+		this->shift_diff_cost = Diff_res<M::p_dim>::Create(this->C_shift_diff.data());
+
+		// spline weights depend only on the position of the sample in its segment,
+		// position spline_spacing is the end of the segment for the next state of its last sample
+		if (this->spline_spacing > 1) {
+			this->spline_w.resize(4*(this->spline_spacing + 1));
+			for (int r = 0; r <= this->spline_spacing; r++)
+				bspline_basis((double)r/this->spline_spacing, &this->spline_w[4*r]);
+		}
+
+		int N_max = 0;
+		for (int k = 0; k < this->pos_data.size(); k++) {
+			const double *o = this->pos_data[k]->data();
+			Traj_input<M> u(this->input_data[k]->data(), this->u_0.data(), u_delay, this->u_delay_shift);
+
+			if (this->spline_spacing > 1) {
+				this->obs_cost.push_back(Spline_obs_res<M>::Create(o, this->spline_w.data(), 
+					this->spline_spacing, this->C_o.data()));
+				this->state_cost.push_back(Spline_state_res<M>::Create(u, this->dt, this->spline_w.data(), 
+					this->spline_spacing, this->C_s.data()));
+			}
+			else {
+				this->obs_cost.push_back(Obs_res<M>::Create(o, this->C_o.data()));
+				this->state_cost.push_back(State_res<M>::Create(u, this->dt, this->C_s.data()));
+			}
+
+			N_max = max(N_max, (int)this->pos_data[k]->rows());
+		}
+
+		// sample index blocks, sized once so their addresses stay valid
+		this->sample_idx.resize(N_max);
+		for (int t = 0; t < N_max; t++) {
+			this->sample_idx[t] = t;
+			this->problem->AddParameterBlock(&this->sample_idx[t], 1);
+			this->problem->SetParameterBlockConstant(&this->sample_idx[t]);
+		}
+	}
+
+	void delete_problem()
+	{
+		// problem owns neither the cost nor the loss functions,
+		// there are only a few per trajectory
+		delete this->problem;
+		this->problem = nullptr;
+
+		delete this->shift_global_cost;
+		delete this->shift_diff_cost;
+		this->shift_global_cost = nullptr;
+		this->shift_diff_cost = nullptr;
+
+		for (auto cost : this->obs_cost)
+			delete cost;
+		for (auto cost : this->state_cost)
+			delete cost;
+		for (auto cost : this->prior_cost)
+			delete cost;
+		this->obs_cost.clear();
+		this->state_cost.clear();
+		this->prior_cost.clear();
+
+		delete this->obs_loss;
+		delete this->state_loss;
+		this->obs_loss = nullptr;
+		this->state_loss = nullptr;
+	}
+
+	void spline_segment(int t, int &i, double *w)
+	{
+		// first control point of the segment of sample t and the weights of its four points
+		i = t/this->spline_spacing;
+		bspline_basis((double)(t - i*this->spline_spacing)/this->spline_spacing, w);
+	}
 
-		CostFunction *cost_fun = State_res<M>::Create(u, this->dt, this->C_s.data());
-		this->problem->AddResidualBlock(cost_fun, this->state_loss, s, s_next, p);
+	void spline_init(int k)
+	{
+		// control points start at the prepared states of the segment starts
+		int N = this->state_est[k]->rows();
+		int n_ctrl = (N - 1)/this->spline_spacing + 4;
+
+		s_mat *ctrl;
+		if (k < this->ctrl_est.size()) {
+			ctrl = this->ctrl_est[k]; // again after the states were smoothed
+		}
+		else {
+			ctrl = new s_mat;
+			this->ctrl_est.push_back(ctrl);
+		}
+
+		ctrl->resize(n_ctrl, M::s_dim);
+		for (int j = 0; j < n_ctrl; j++) {
+			int t = min(max((j - 1)*this->spline_spacing, 0), N - 1);
+			ctrl->row(j) = this->state_est[k]->row(t);
+		}
 	}
 
-	void add_param_shift_global(int k, int t)
+	void spline_eval(int k)
 	{
+		// states at the samples from the control points
+		int i;
+		double w[4];
+		for (int t = 0; t < this->state_est[k]->rows(); t++) {
+			this->spline_segment(t, i, w);
+			this->state_est[k]->row(t).setZero();
+			for (int j = 0; j < 4; j++)
+				this->state_est[k]->row(t) += w[j]*this->ctrl_est[k]->row(i + j);
+		}
+	}
+
+	void add_param_shift_global(int k, int j)
+	{
+		// j is the segment index
 		assert(k < this->param_shift_est.size());
-		assert(t < this->param_shift_est[k]->rows());
+		assert(j < this->param_shift_est[k]->rows());
 
-		double *p = this->param_shift_est[k]->row(t).data();
+		double *p = this->param_shift_est[k]->row(j).data();
 		double *p_global = this->param_est.data();
 
-		CostFunction *cost_fun = Diff_res<M::p_dim>::Create(this->C_shift_global.data());
-		this->problem->AddResidualBlock(cost_fun, nullptr, p, p_global);
+		this->problem->AddResidualBlock(this->shift_global_cost, nullptr, p, p_global);
 
 		for (int i = 0; i < M::p_dim; i++) {
 			this->problem->SetParameterLowerBound(p, i, this->param_lb[i]);
@@ -217,23 +483,23 @@ public:
 
 	}
 
-	void add_param_shift_diff(int k, int t)
+	void add_param_shift_diff(int k, int j)
 	{
 		assert(k < this->param_shift_est.size());
-		assert(t < this->param_shift_est[k]->rows() - 1);
+		assert(j < this->param_shift_est[k]->rows() - 1);
 
-		double *p = this->param_shift_est[k]->row(t).data();
-		double *p_next = this->param_shift_est[k]->row(t+1).data();
+		double *p = this->param_shift_est[k]->row(j).data();
+		double *p_next = this->param_shift_est[k]->row(j+1).data();
 
-		CostFunction *cost_fun = Diff_res<M::p_dim>::Create(this->C_shift_diff.data());
-		this->problem->AddResidualBlock(cost_fun, nullptr, p, p_next);
+		this->problem->AddResidualBlock(this->shift_diff_cost, nullptr, p, p_next);
 	}
 
 	template<int S>
 	void add_prior(double *x, const double *x_p, const double *C)
 	{
 		CostFunction *cost_fun = Prior_res<S>::Create(x_p, C);
-		problem->AddResidualBlock(cost_fun, nullptr, x);
+		this->prior_cost.push_back(cost_fun);
+		this->problem->AddResidualBlock(cost_fun, nullptr, x);
 	}
 
 	void add_trajectory(o_mat &pos, u_mat &input)
@@ -241,30 +507,61 @@ public:
 		o_mat *o_data = new o_mat;
 		u_mat *u_data = new u_mat;
 
-		this->pos_data.push_back(o_data);
-		this->input_data.push_back(u_data);
-
 		o_data->operator=(pos);
 		u_data->operator=(input);
 
-		int N = pos.rows();
+		this->add_trajectory_data(o_data, u_data);
+	}
+
+	void share_trajectories(const Model_ident<M> &src, const vector<int> &idx)
+	{
+		// use trajectories idx of src read-only, only the estimates are owned,
+		// states start from the current estimates of src with its outlier flags
+		assert(this->pos_data.size() == 0 || !this->owns_data);
+		this->owns_data = false;
+
+		for (int k : idx) {
+			this->add_trajectory_data(src.pos_data[k], src.input_data[k]);
+
+			int j = this->state_est.size() - 1;
+			*(this->state_est[j]) = *(src.state_est[k]);
+			this->obs_outlier[j] = src.obs_outlier[k];
+
+			if (this->spline_spacing > 1)
+				this->spline_init(j);
+		}
+	}
+
+	void add_trajectory_data(o_mat *o_data, u_mat *u_data)
+	{
+		this->pos_data.push_back(o_data);
+		this->input_data.push_back(u_data);
+
+		int N = o_data->rows();
 
 		s_mat *s_est = new s_mat;
 		this->state_est.push_back(s_est);
 		s_est->conservativeResize(N, M::s_dim);
 		s_est->setZero();
 
+		this->obs_outlier.push_back(vector<bool>(N, false));
+
 		if (this->use_param_shift) {
+			// one block for every param_shift_segment state transitions
+			int n_seg = (N - 2)/this->param_shift_segment + 1;
 			p_mat *p_shift_est = new p_mat;
 			this->param_shift_est.push_back(p_shift_est);
-			p_shift_est->conservativeResize(N-1, M::s_dim);
-			for (int t = 0; t < N-1; t++) {
-				p_shift_est->row(t) = this->param_prior;
+			p_shift_est->conservativeResize(n_seg, M::p_dim);
+			for (int j = 0; j < n_seg; j++) {
+				p_shift_est->row(j) = this->param_prior;
 			}
 		}
 
 		// prep values in the last state estimate
 		this->prep_values(this->state_est.size()-1);
+
+		if (this->spline_spacing > 1)
+			this->spline_init(this->state_est.size()-1);
 	}
 
 	void prep_values(int k) {
@@ -288,53 +585,110 @@ public:
 
 	void clear_trajectories()
 	{
-		for (int i; i < this->state_est.size(); i++)
+		for (int i = 0; i < this->state_est.size(); i++)
 			delete this->state_est[i];
 
-		for (int i; i < this->pos_data.size(); i++)
-			delete this->pos_data[i];
-		
-		for (int i; i < this->input_data.size(); i++)
-			delete this->input_data[i];
+		if (this->owns_data) {
+			for (int i = 0; i < this->pos_data.size(); i++)
+				delete this->pos_data[i];
+			
+			for (int i = 0; i < this->input_data.size(); i++)
+				delete this->input_data[i];
+		}
 
-		for (int i; i < this->param_shift_est.size(); i++)
+		for (int i = 0; i < this->param_shift_est.size(); i++)
 			delete this->param_shift_est[i];
+
+		for (int i = 0; i < this->ctrl_est.size(); i++)
+			delete this->ctrl_est[i];
+
+		this->state_est.clear();
+		this->obs_outlier.clear();
+		this->ctrl_est.clear();
+		this->pos_data.clear();
+		this->input_data.clear();
+		this->param_shift_est.clear();
 	}
 
 	void build_problem(int u_delay)
 	{
 		assert(this->state_est.size() == this->pos_data.size() && this->state_est.size() == this->pos_data.size());
-		delete this->problem; // nothing happens for fresh, nullptr
+		this->delete_problem(); // nothing happens for fresh, nullptr
 
-		this->problem = new Problem();
+		Problem::Options problem_options;
+		problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+		problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+		this->problem = new Problem(problem_options);
 
+		this->create_costs(u_delay);
 		this->set_loss();
-		this->set_model_par_prior(this->param_prior);
+		if (this->use_param_prior)
+			this->set_model_par_prior(this->param_prior);
+		else
+			this->param_est = this->param_prior;
 		this->set_model_par_bounds();
 
 		// for (int k = 0; k < this->state_est.size(); k++)
 		// 	this->prep_values(k);
 
-		double *s;
-		double *s_next;
-		double *u;
-		double *o;
-
 		for (int k = 0; k < this->pos_data.size(); k++) {
 			int N = this->pos_data[k]->rows();
 			for (int t = 0; t < N; t++) {
 
-				this->add_obs(k, t);
+				if (!this->obs_outlier[k][t])
+					this->add_obs(k, t);
 				if (t == N - 1) continue; // cant res for last state
-				this->add_state(k, t, u_delay);
-				if (this->use_param_shift)
-					this->add_param_shift_global(k, t);
+				this->add_state(k, t);
+			}
+
+			if (!this->use_param_shift) continue;
+			int n_seg = this->param_shift_est[k]->rows();
+			for (int j = 0; j < n_seg; j++) {
+				this->add_param_shift_global(k, j);
+				if (j < n_seg - 1)
+					this->add_param_shift_diff(k, j);
+			}
+		}
 
-				if (t == N - 2) continue;
-				if (this->use_param_shift)
-					this->add_param_shift_diff(k, t);
+		if (this->solver_options.linear_solver_type == ceres::SPARSE_SCHUR ||
+			this->solver_options.linear_solver_type == ceres::DENSE_SCHUR ||
+			this->solver_options.linear_solver_type == ceres::ITERATIVE_SCHUR) {
+			this->set_ordering();
+		}
+	}
+
+	void set_ordering()
+	{
+		// schur eliminates the first group, it has to be an independent set,
+		// neighbouring states share a residual so even states go first, odd states second,
+		// spline residuals share four control points so every fourth goes first,
+		// parameters are left in the reduced system
+		auto ordering = make_shared<ParameterBlockOrdering>();
+
+		if (this->spline_spacing > 1) {
+			for (int k = 0; k < this->ctrl_est.size(); k++) {
+				for (int j = 0; j < this->ctrl_est[k]->rows(); j++) {
+					ordering->AddElementToGroup(this->ctrl_est[k]->row(j).data(), j % 4 == 0 ? 0 : 1);
+				}
+			}
+		}
+		else {
+			for (int k = 0; k < this->state_est.size(); k++) {
+				for (int t = 0; t < this->state_est[k]->rows(); t++) {
+					ordering->AddElementToGroup(this->state_est[k]->row(t).data(), t % 2);
+				}
+			}
+		}
+
+		for (int k = 0; k < this->param_shift_est.size(); k++) {
+			for (int t = 0; t < this->param_shift_est[k]->rows(); t++) {
+				ordering->AddElementToGroup(this->param_shift_est[k]->row(t).data(), 2);
 			}
 		}
+
+		ordering->AddElementToGroup(this->param_est.data(), 2);
+
+		this->solver_options.linear_solver_ordering = ordering;
 	}
 
 	s_vec calculate_state_equation_corr(p_vec &par_est, double dt, int u_delay)
@@ -402,8 +756,80 @@ public:
 
 	void solve(Solver::Summary *summary) {
 		Solve(this->solver_options, this->problem, summary);
+
+		for (int k = 0; k < this->ctrl_est.size(); k++)
+			this->spline_eval(k);
 	}
 
+	bool param_covariance(p_cov_mat &cov)
+	{
+		// covariance of param_est from the jacobian at the solution, states are 
+		// eliminated by ceres, bounds are not taken into account, call after solve
+		if (this->problem == nullptr)
+			return false;
+
+		Covariance::Options cov_options;
+		cov_options.num_threads = this->solver_options.num_threads;
+		cov_options.algorithm_type = ceres::SPARSE_QR;
+		Covariance covariance(cov_options);
+
+		vector<pair<const double *, const double *>> blocks;
+		blocks.push_back(make_pair(this->param_est.data(), this->param_est.data()));
+
+		if (!covariance.Compute(blocks, this->problem)) {
+			cerr << "parameter covariance failed, jacobian is rank deficient" << endl;
+			return false;
+		}
+
+		return covariance.GetCovarianceBlock(this->param_est.data(), this->param_est.data(), cov.data());
+	}
+
+	p_mat bootstrap(int n_samples, int u_delay);
+	void bootstrap_worker(p_mat *result, atomic<int> *next, int u_delay, int solver_threads);
+
+	double rollout_sse(int k, const p_vec &p, int u_delay, int t0, int n_steps, int &n);
+	Eigen::MatrixXd cross_validate(int n_folds, int u_delay, int horizon);
+	void cv_worker(Eigen::MatrixXd *metrics, atomic<int> *next, int u_delay, int horizon, int solver_threads);
+
+	void warm_start(const Model_ident<M> &src)
+	{
+		// copy estimates of an instance with the same trajectories, call after build_problem
+		for (int k = 0; k < this->state_est.size(); k++)
+			*(this->state_est[k]) = *(src.state_est[k]);
+
+		for (int k = 0; k < this->param_shift_est.size(); k++)
+			*(this->param_shift_est[k]) = *(src.param_shift_est[k]);
+
+		for (int k = 0; k < this->ctrl_est.size(); k++)
+			*(this->ctrl_est[k]) = *(src.ctrl_est[k]);
+
+		this->param_est = src.param_est;
+	}
+
+	void solve_multistart(int u_delay);
+	void multistart_worker(vector<p_vec> *starts, vector<Model_ident<M> *> *kept, 
+		vector<double> *kept_costs, int n_keep, mutex *mtx, atomic<int> *next, int u_delay, int solver_threads);
+	void multistart_finish_worker(vector<Model_ident<M> *> *kept, vector<double> *kept_costs, 
+		atomic<int> *next, int solver_threads);
+
+	void smooth_trajectories();
+	void smooth_worker(atomic<int> *next, atomic<int> *n_outliers);
+	int smooth_trajectory(int k);
+
+	void save_checkpoint(const string &file, const vector<string> &names);
+	int load_checkpoint(const string &file, const vector<string> &names);
+
+	void solve_admm(int u_delay);
+	void admm_worker(vector<Model_ident<M> *> *shards, atomic<int> *next);
+
+	void solve_stochastic(const vector<string> &files, int u_delay);
+	void stochastic_worker(const vector<string> *files, p_mat *result, atomic<int> *next,
+		const p_vec *z, int it, int u_delay, int solver_threads);
+
+	int delay_search(int d_min, int d_max, Eigen::VectorXd &scores);
+	void delay_worker(vector<Model_ident<M> *> *cands, vector<bool> *solved, mutex *mtx, condition_variable *cv,
+		atomic<int> *next, Eigen::VectorXd *costs, int d_min, int wave, int solver_threads);
+
 	void set_loss()
 	{
 		if (this->obs_loss_s > 0) {
@@ -418,6 +844,15 @@ public:
 	LossFunctionWrapper* obs_loss = nullptr;
 	LossFunctionWrapper* state_loss = nullptr;
 
+	CostFunction* shift_global_cost = nullptr;
+	CostFunction* shift_diff_cost = nullptr;
+	vector<CostFunction *> obs_cost; // by trajectory
+	vector<CostFunction *> state_cost;
+	vector<CostFunction *> prior_cost;
+
+	vector<double> spline_w; // basis weights by position in the segment
+	vector<double> sample_idx; // constant index blocks, sample t at t
+
 	double state_loss_s = 0;
 	double obs_loss_s = 0;
 	
@@ -430,6 +865,8 @@ public:
 
 	vector<s_mat *> state_est;
 	vector<p_mat *> param_shift_est;
+	vector<s_mat *> ctrl_est; // spline control points, states are evaluated after solve
+	vector<vector<bool>> obs_outlier; // samples without observation residual
 	p_vec C_shift_global;
 	p_vec C_shift_diff;
 
@@ -449,11 +886,918 @@ public:
 
 	double dt;
 	bool use_param_shift = false;
+	bool u_delay_shift = false; // pair states with inputs u_delay steps earlier
+	int param_shift_segment = 1; // state transitions sharing one parameter shift block
+	int spline_spacing = 0; // samples between spline knots, states at every sample if <= 1
+	bool use_param_prior = true; // false for admm shards, prior is applied in the consensus
+	bool owns_data = true; // false if trajectories are shared from another instance
+
+	json config;
+
+	// bootstrap, resamples trajectories with replacement
+	int bootstrap_threads = 0; // 0 for hardware concurrency
+	unsigned int bootstrap_seed = 0;
+
+	// cross-validation, trajectory k is held out in fold k % folds
+	int cv_threads = 0; // 0 for hardware concurrency
+
+	// delay search, candidates are scored by state equation correlation or final cost
+	int delay_threads = 0; // 0 for hardware concurrency
+	bool delay_score_cost = false;
+
+	// consensus admm, trajectories are split into shards with own parameters
+	int admm_shards = 0; // 0 solves one problem
+	int admm_threads = 0; // 0 for hardware concurrency
+	int admm_max_iter = 50;
+	double admm_rho = 10;
+	double admm_tol = 1e-4;
+
+	// stochastic mode, random windows are read from the log files every iteration,
+	// window parameters are pulled to the current estimate with weight sgd_C_prox
+	int sgd_iter = 100;
+	int sgd_batch = 8; // windows per iteration
+	int sgd_window = 200; // samples per window
+	int sgd_threads = 0; // 0 for hardware concurrency
+	unsigned int sgd_seed = 0;
+	double sgd_lr = 0.5;
+	double sgd_momentum = 0.5;
+	double sgd_C_prox = 10;
+	bool sgd_average = false; // average the estimates of the second half of iterations
+	vector<int> sgd_rows; // samples of every log file, indexed once
+	vector<vector<streampos>> sgd_offsets; // line offsets of every sgd_stride-th sample
+	static const int sgd_stride = 64;
+
+	// multi-start, random initial parameters within bounds, short solves first
+	int multistart_starts = 0; // 0 solves from the prior only
+	int multistart_keep = 2; // starts solved to convergence
+	int multistart_iter = 10; // iterations of the short solves
+	int multistart_threads = 0; // 0 for hardware concurrency
+	unsigned int multistart_seed = 0;
+
+	// smoothed initial values, constant velocity rts smoother of every output,
+	// observations with a normalized innovation above smooth_gate are outliers
+	bool smooth_init = false;
+	int smooth_threads = 0; // 0 for hardware concurrency
+	double smooth_gate = 5; // 0 flags nothing
+	o_vec smooth_acc_sd; // white acceleration sd of the outputs
 };
 
+template<typename M>
+void Model_ident<M>::solve_admm(int u_delay)
+{
+	// scaled form, shard i minimizes its cost + rho/2 |p_i - z + y_i|^2,
+	// z minimizes the parameter prior + sum of rho/2 |p_i + y_i - z|^2 within bounds,
+	// y_i += p_i - z
+	const int K = this->pos_data.size();
+	const int n = min(this->admm_shards, K);
+
+	vector<Model_ident<M> *> shards(n);
+	vector<vector<int>> shard_idx(n);
+	vector<p_vec> y(n, p_vec::Zero());
+	vector<p_vec> target(n); // z - y_i, read by the consensus residual of each shard
+	p_vec C_rho = p_vec::Constant(sqrt(this->admm_rho));
+
+	p_vec z = this->param_prior;
+	p_vec z_prev;
+
+	for (int k = 0; k < K; k++)
+		shard_idx[k % n].push_back(k);
+
+	for (int i = 0; i < n; i++) {
+		shards[i] = new Model_ident<M>;
+		shards[i]->set_config(this->config);
+		shards[i]->solver_options.minimizer_progress_to_stdout = false;
+		shards[i]->use_param_prior = false;
+		shards[i]->share_trajectories(*this, shard_idx[i]);
+		shards[i]->build_problem(u_delay);
+
+		target[i] = z;
+		shards[i]->template add_prior<M::p_dim>(shards[i]->param_est.data(), target[i].data(), C_rho.data());
+	}
+
+	int n_threads = this->admm_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = min(n_threads, n);
+
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads);
+	for (auto shard : shards)
+		shard->solver_options.num_threads = solver_threads;
+
+	for (int it = 0; it < this->admm_max_iter; it++) {
+		atomic<int> next = 0;
+		vector<thread> workers;
+		for (int j = 0; j < n_threads; j++)
+			workers.push_back(thread(&Model_ident<M>::admm_worker, this, &shards, &next));
+
+		for (auto &w : workers)
+			w.join();
+
+		// consensus, quadratic prior and box bounds are separable so clamping is exact
+		z_prev = z;
+		p_vec C2 = this->C_prior.cwiseProduct(this->C_prior);
+		p_vec sum = p_vec::Zero();
+		for (int i = 0; i < n; i++)
+			sum += shards[i]->param_est + y[i];
+
+		z = (C2.cwiseProduct(this->param_prior) + this->admm_rho*sum).cwiseQuotient(
+			C2 + p_vec::Constant(n*this->admm_rho));
+		z = z.cwiseMax(this->param_lb).cwiseMin(this->param_ub);
+
+		double r_primal = 0;
+		for (int i = 0; i < n; i++) {
+			y[i] += shards[i]->param_est - z;
+			target[i] = z - y[i];
+			r_primal += (shards[i]->param_est - z).squaredNorm();
+		}
+		r_primal = sqrt(r_primal);
+		double r_dual = this->admm_rho*sqrt(n)*(z - z_prev).norm();
+
+		cout << "admm it " << it << ", primal res " << r_primal << ", dual res " << r_dual 
+			<< ", par est " << z.transpose() << endl;
+
+		if (r_primal < this->admm_tol && r_dual < this->admm_tol)
+			break;
+	}
+
+	this->param_est = z;
+
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < shard_idx[i].size(); j++) {
+			int k = shard_idx[i][j];
+			*(this->state_est[k]) = *(shards[i]->state_est[j]);
+			if (this->use_param_shift)
+				*(this->param_shift_est[k]) = *(shards[i]->param_shift_est[j]);
+			if (this->spline_spacing > 1)
+				*(this->ctrl_est[k]) = *(shards[i]->ctrl_est[j]);
+		}
+		delete shards[i];
+	}
+}
+
+template<typename M>
+void Model_ident<M>::admm_worker(vector<Model_ident<M> *> *shards, atomic<int> *next)
+{
+	Solver::Summary summary;
+	for (int i = (*next)++; i < shards->size(); i = (*next)++) {
+		(*shards)[i]->solve(&summary);
+	}
+}
+
+template<typename M>
+void Model_ident<M>::solve_stochastic(const vector<string> &files, int u_delay)
+{
+	// only one batch of windows is in memory, the estimate z moves 
+	// to the mean of the window estimates with momentum and stays within bounds
+	p_mat result(this->sgd_batch, M::p_dim);
+	p_vec z = this->param_prior;
+	p_vec v = p_vec::Zero();
+	p_vec z_sum = p_vec::Zero();
+	int n_sum = 0;
+
+	int n_threads = this->sgd_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = min(n_threads, this->sgd_batch);
+
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads);
+
+	// every file is scanned once, windows then read only their own lines
+	this->sgd_rows.resize(files.size());
+	this->sgd_offsets.resize(files.size());
+	for (int f = 0; f < files.size(); f++)
+		this->sgd_offsets[f] = Parser::index_log(files[f], "pos", this->sgd_stride, this->sgd_rows[f]);
+
+	for (int it = 0; it < this->sgd_iter; it++) {
+		atomic<int> next = 0;
+		vector<thread> workers;
+		for (int i = 0; i < n_threads; i++)
+			workers.push_back(thread(&Model_ident<M>::stochastic_worker, this,
+				&files, &result, &next, &z, it, u_delay, solver_threads));
+
+		for (auto &w : workers)
+			w.join();
+
+		p_vec mean = p_vec::Zero();
+		int n = 0;
+		for (int b = 0; b < result.rows(); b++) {
+			if (result.row(b).hasNaN())
+				continue; // trajectory shorter than the delay
+			mean += result.row(b).transpose();
+			n += 1;
+		}
+
+		if (n == 0)
+			continue;
+
+		v = this->sgd_momentum*v + (mean/n - z);
+		z = (z + this->sgd_lr*v).cwiseMax(this->param_lb).cwiseMin(this->param_ub);
+
+		if (this->sgd_average && 2*it >= this->sgd_iter) {
+			z_sum += z;
+			n_sum += 1;
+		}
+
+		cout << "sgd it " << it << ", step " << (this->sgd_lr*v).norm() << ", par est " << z.transpose() << endl;
+	}
+
+	this->param_est = z;
+	if (n_sum > 0)
+		this->param_est = z_sum/n_sum;
+}
+
+template<typename M>
+void Model_ident<M>::stochastic_worker(const vector<string> *files, p_mat *result, atomic<int> *next,
+	const p_vec *z, int it, int u_delay, int solver_threads)
+{
+	Solver::Summary summary;
+	o_mat pos, o_win;
+	u_mat input, u_win;
+
+	for (int b = (*next)++; b < result->rows(); b = (*next)++) {
+		mt19937 rng(this->sgd_seed + it*result->rows() + b);
+		uniform_int_distribution<int> file_dist(0, files->size() - 1);
+		int f = file_dist(rng);
+
+		int N = this->sgd_rows[f];
+		int W = min(this->sgd_window, N - u_delay);
+		if (W < 2) {
+			result->row(b).setConstant(NAN);
+			continue;
+		}
+
+		// inputs are paired as by delayed_input, the window is solved with zero delay,
+		// only the lines of the window and its inputs are read
+		uniform_int_distribution<int> t_dist(u_delay, N - W);
+		int t0 = t_dist(rng);
+		int u0 = this->u_delay_shift ? t0 - u_delay : t0;
+		int id_min = min(t0, u0);
+		int id_max = t0 + W - 1;
+
+		auto data = Parser::parse_log_range((*files)[f], {"input", "pos"}, 
+			this->sgd_offsets[f][id_min/this->sgd_stride], id_min, id_max);
+		Parser::fill_matrix<M::o_dim>(pos, data["pos"]);
+		Parser::fill_matrix<M::u_dim>(input, data["input"]);
+
+		o_win = pos.middleRows(t0 - id_min, W);
+		u_win = input.middleRows(u0 - id_min, W);
+
+		Model_ident<M> window;
+		window.set_config(this->config);
+		window.solver_options.minimizer_progress_to_stdout = false;
+		window.solver_options.num_threads = solver_threads;
+		window.param_prior = *z;
+		window.C_prior.setConstant(this->sgd_C_prox);
+		window.add_trajectory(o_win, u_win);
+		window.build_problem(0);
+		window.solve(&summary);
+
+		result->row(b) = window.param_est;
+	}
+}
+
+template<typename M>
+int Model_ident<M>::delay_search(int d_min, int d_max, Eigen::VectorXd &scores)
+{
+	// every delay is solved by its own instance sharing the trajectory data,
+	// d_min is solved first, the others outward from it in waves of n_threads solved in parallel,
+	// a wave starts when the last delay of the previous one is solved and every delay
+	// is warm-started from the nearest solved one, the best is copied to this instance
+	int n = d_max - d_min + 1;
+	vector<Model_ident<M> *> cands(n);
+	vector<bool> solved(n, false);
+	Eigen::VectorXd costs(n);
+	mutex mtx;
+	condition_variable cv;
+	atomic<int> next = 0;
+
+	vector<int> idx(this->pos_data.size());
+	for (int k = 0; k < idx.size(); k++)
+		idx[k] = k;
+
+	for (int j = 0; j < n; j++) {
+		cands[j] = new Model_ident<M>;
+		cands[j]->set_config(this->config);
+		cands[j]->share_trajectories(*this, idx);
+	}
+
+	int n_threads = this->delay_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = max(1, min(n_threads, n - 1));
+
+	this->delay_worker(&cands, &solved, &mtx, &cv, &next, &costs, d_min, n_threads, this->solver_options.num_threads);
+
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads);
+	vector<thread> workers;
+	for (int i = 0; i < n_threads && n > 1; i++)
+		workers.push_back(thread(&Model_ident<M>::delay_worker, this, 
+			&cands, &solved, &mtx, &cv, &next, &costs, d_min, n_threads, solver_threads));
+
+	for (auto &w : workers)
+		w.join();
+
+	scores.resize(n);
+	int best = 0;
+	for (int j = 0; j < n; j++) {
+		if (this->delay_score_cost)
+			scores[j] = -costs[j];
+		else
+			scores[j] = cands[j]->calculate_state_equation_corr(cands[j]->param_est, this->dt, d_min + j).mean();
+
+		cout << "delay: " << d_min + j << ", score: " << scores[j] << ", cost: " << costs[j] << endl;
+		if (scores[j] > scores[best])
+			best = j;
+	}
+
+	for (int k = 0; k < this->state_est.size(); k++)
+		*(this->state_est[k]) = *(cands[best]->state_est[k]);
+	for (int k = 0; k < this->param_shift_est.size(); k++)
+		*(this->param_shift_est[k]) = *(cands[best]->param_shift_est[k]);
+	for (int k = 0; k < this->ctrl_est.size(); k++)
+		*(this->ctrl_est[k]) = *(cands[best]->ctrl_est[k]);
+	this->param_est = cands[best]->param_est;
+
+	for (auto cand : cands)
+		delete cand;
+
+	return d_min + best;
+}
+
+template<typename M>
+void Model_ident<M>::delay_worker(vector<Model_ident<M> *> *cands, vector<bool> *solved, mutex *mtx, condition_variable *cv,
+	atomic<int> *next, Eigen::VectorXd *costs, int d_min, int wave, int solver_threads)
+{
+	Solver::Summary summary;
+	const int n = cands->size();
+
+	for (int j = (*next)++; j < n; j = (*next)++) {
+		Model_ident<M> *cand = (*cands)[j];
+		cand->solver_options.minimizer_progress_to_stdout = false;
+		cand->solver_options.num_threads = solver_threads;
+		cand->build_problem(d_min + j);
+
+		// delays are taken in order, the wave before j ends at j_prev,
+		// it is taken earlier so the wait always ends
+		unique_lock<mutex> lck(*mtx);
+		int j_prev = j > 0 ? ((j - 1)/wave)*wave : 0;
+		while (j > 0 && !(*solved)[j_prev])
+			cv->wait(lck);
+
+		for (int i = 1; i < n; i++) {
+			if (j - i >= 0 && (*solved)[j - i]) {
+				cand->warm_start(*(*cands)[j - i]);
+				break;
+			}
+			if (j + i < n && (*solved)[j + i]) {
+				cand->warm_start(*(*cands)[j + i]);
+				break;
+			}
+		}
+		lck.unlock();
+
+		cand->solve(&summary);
+		(*costs)[j] = summary.final_cost;
+
+		lck.lock();
+		(*solved)[j] = true;
+		lck.unlock();
+		cv->notify_all();
+
+		cerr << "delay " << d_min + j << " par est " << cand->param_est.transpose() << endl;
+
+		if (j == 0)
+			break; // first delay is solved alone
+	}
+}
+
+template<typename M>
+void Model_ident<M>::solve_multistart(int u_delay)
+{
+	// every start is solved by its own instance sharing the trajectory data,
+	// first multistart_iter iterations only, the multistart_keep lowest costs are
+	// kept and solved to convergence in parallel, the best is copied to this instance
+	const int n = this->multistart_starts;
+	const int n_keep = max(1, min(this->multistart_keep, n));
+
+	// start 0 is the prior, the others are uniform within bounds
+	vector<p_vec> starts(n);
+	mt19937 rng(this->multistart_seed);
+	uniform_real_distribution<double> dist(0, 1);
+	starts[0] = this->param_prior;
+	for (int j = 1; j < n; j++) {
+		for (int i = 0; i < M::p_dim; i++)
+			starts[j][i] = this->param_lb[i] + dist(rng)*(this->param_ub[i] - this->param_lb[i]);
+	}
+
+	vector<Model_ident<M> *> kept;
+	vector<double> kept_costs;
+	mutex mtx;
+	atomic<int> next = 0;
+
+	int n_threads = this->multistart_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = min(n_threads, n);
+
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads); // split cores between starts
+	vector<thread> workers;
+	for (int i = 0; i < n_threads; i++)
+		workers.push_back(thread(&Model_ident<M>::multistart_worker, this, 
+			&starts, &kept, &kept_costs, n_keep, &mtx, &next, u_delay, solver_threads));
+
+	for (auto &w : workers)
+		w.join();
+
+	// continue the kept starts, the problems are already built
+	n_threads = min(n_threads, (int)kept.size());
+	solver_threads = max(1, this->solver_options.num_threads/n_threads);
+	next = 0;
+
+	workers.clear();
+	for (int i = 0; i < n_threads; i++)
+		workers.push_back(thread(&Model_ident<M>::multistart_finish_worker, this, 
+			&kept, &kept_costs, &next, solver_threads));
+
+	for (auto &w : workers)
+		w.join();
+
+	int best = 0;
+	for (int j = 0; j < kept.size(); j++) {
+		cout << "start: " << j << ", cost: " << kept_costs[j] << ", par est " << kept[j]->param_est.transpose() << endl;
+		if (kept_costs[j] < kept_costs[best])
+			best = j;
+	}
+
+	this->warm_start(*kept[best]);
+
+	for (auto cand : kept)
+		delete cand;
+}
+
+template<typename M>
+void Model_ident<M>::multistart_worker(vector<p_vec> *starts, vector<Model_ident<M> *> *kept, 
+	vector<double> *kept_costs, int n_keep, mutex *mtx, atomic<int> *next, int u_delay, int solver_threads)
+{
+	// only n_keep instances outlive their truncated solve
+	Solver::Summary summary;
+
+	vector<int> idx(this->pos_data.size());
+	for (int k = 0; k < idx.size(); k++)
+		idx[k] = k;
+
+	for (int j = (*next)++; j < starts->size(); j = (*next)++) {
+		Model_ident<M> *cand = new Model_ident<M>;
+		cand->set_config(this->config);
+		cand->solver_options.minimizer_progress_to_stdout = false;
+		cand->solver_options.num_threads = solver_threads;
+		cand->solver_options.max_num_iterations = this->multistart_iter;
+		cand->share_trajectories(*this, idx);
+		cand->build_problem(u_delay);
+		cand->param_est = (*starts)[j]; // prior is unchanged, only the initial value
+
+		cand->solve(&summary);
+		double cost = summary.final_cost;
+
+		cerr << "start " << j << " from " << (*starts)[j].transpose() << " cost " << cost << endl;
+
+		unique_lock<mutex> lck(*mtx);
+		if (kept->size() < n_keep) {
+			kept->push_back(cand);
+			kept_costs->push_back(cost);
+			continue;
+		}
+
+		int worst = 0;
+		for (int i = 1; i < kept->size(); i++) {
+			if ((*kept_costs)[i] > (*kept_costs)[worst])
+				worst = i;
+		}
+
+		if (cost < (*kept_costs)[worst]) {
+			swap((*kept)[worst], cand);
+			(*kept_costs)[worst] = cost;
+		}
+		lck.unlock();
+
+		delete cand;
+	}
+}
+
+template<typename M>
+void Model_ident<M>::multistart_finish_worker(vector<Model_ident<M> *> *kept, vector<double> *kept_costs, 
+	atomic<int> *next, int solver_threads)
+{
+	Solver::Summary summary;
+
+	for (int j = (*next)++; j < kept->size(); j = (*next)++) {
+		Model_ident<M> *cand = (*kept)[j];
+		cand->solver_options.num_threads = solver_threads;
+		cand->solver_options.max_num_iterations = this->solver_options.max_num_iterations;
+
+		cand->solve(&summary);
+		(*kept_costs)[j] = summary.final_cost;
+	}
+}
+
+template<typename M>
+typename Model_ident<M>::p_mat Model_ident<M>::bootstrap(int n_samples, int u_delay)
+{
+	// every sample is solved by its own instance sharing the trajectory data
+	p_mat result(n_samples, M::p_dim);
+	atomic<int> next = 0;
+
+	int n_threads = this->bootstrap_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = min(n_threads, n_samples);
+
+	vector<thread> workers;
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads); // split cores between samples
+	for (int i = 0; i < n_threads; i++)
+		workers.push_back(thread(&Model_ident<M>::bootstrap_worker, this, &result, &next, u_delay, solver_threads));
+
+	for (auto &w : workers)
+		w.join();
+
+	return result;
+}
+
+template<typename M>
+void Model_ident<M>::bootstrap_worker(p_mat *result, atomic<int> *next, int u_delay, int solver_threads)
+{
+	const int K = this->pos_data.size();
+	vector<int> idx(K);
+	Solver::Summary summary;
+
+	for (int b = (*next)++; b < result->rows(); b = (*next)++) {
+		mt19937 rng(this->bootstrap_seed + b);
+		uniform_int_distribution<int> dist(0, K - 1);
+		for (int k = 0; k < K; k++)
+			idx[k] = dist(rng);
+
+		Model_ident<M> sample;
+		sample.set_config(this->config);
+		sample.solver_options.minimizer_progress_to_stdout = false;
+		sample.solver_options.num_threads = solver_threads;
+		sample.share_trajectories(*this, idx);
+		sample.build_problem(u_delay);
+		sample.solve(&summary);
+
+		result->row(b) = sample.param_est;
+		cerr << "bootstrap " << b + 1 << "/" << result->rows() << " par est " << sample.param_est.transpose() << endl;
+	}
+}
+
+template<typename M>
+void Model_ident<M>::smooth_trajectories()
+{
+	// replaces the prepared values, trajectories are independent and smoothed in parallel
+	const int K = this->state_est.size();
+	atomic<int> next = 0;
+	atomic<int> n_outliers = 0;
+
+	int n_threads = this->smooth_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = max(1, min(n_threads, K));
+
+	vector<thread> workers;
+	for (int i = 0; i < n_threads; i++)
+		workers.push_back(thread(&Model_ident<M>::smooth_worker, this, &next, &n_outliers));
+
+	for (auto &w : workers)
+		w.join();
+
+	cerr << "smoothed " << K << " trajectories, " << n_outliers << " outliers" << endl;
+}
+
+template<typename M>
+void Model_ident<M>::smooth_worker(atomic<int> *next, atomic<int> *n_outliers)
+{
+	for (int k = (*next)++; k < this->state_est.size(); k = (*next)++) {
+		*n_outliers += this->smooth_trajectory(k);
+
+		if (this->spline_spacing > 1)
+			this->spline_init(k);
+	}
+}
+
+template<typename M>
+int Model_ident<M>::smooth_trajectory(int k)
+{
+	// kalman filter and rts smoother with state (x, v) for every output, the outputs
+	// are independent so all of them are one row of arrays, P = [P00 P01; P01 P11],
+	// obs sd = 1/C_o as in the kf, innovations of the angle M::a_idx are wrapped,
+	// returns the number of outliers
+	typedef Eigen::Array<double, 1, M::o_dim> o_row;
+	typedef Eigen::Array<double, -1, M::o_dim, Eigen::RowMajor> o_arr;
+
+	const o_mat &o = *(this->pos_data[k]);
+	const int N = o.rows();
+	const double dt = this->dt;
+
+	o_row r = this->C_o.array().square().inverse().transpose();
+	o_row q = this->smooth_acc_sd.array().square().transpose();
+	o_row q00 = q*pow(dt, 4)/4;
+	o_row q01 = q*pow(dt, 3)/2;
+	o_row q11 = q*dt*dt;
+
+	// filtered and predicted means, predicted covariances are needed for the gains
+	o_arr x_f, v_f, x_p, v_p;
+	o_arr P00_f, P01_f, P11_f, P00_p, P01_p, P11_p;
+	for (o_arr *a : {&x_f, &v_f, &x_p, &v_p, &P00_f, &P01_f, &P11_f, &P00_p, &P01_p, &P11_p})
+		a->resize(N, M::o_dim);
+
+	o_row x = o.row(0).array();
+	o_row v = o_row::Zero();
+	o_row P00 = r;
+	o_row P01 = o_row::Zero();
+	o_row P11 = 2*r/(dt*dt); // finite difference velocity
+
+	int n_outliers = 0;
+	for (int t = 0; t < N; t++) {
+		if (t > 0) {
+			x += dt*v;
+			P00 += 2*dt*P01 + dt*dt*P11 + q00;
+			P01 += dt*P11 + q01;
+			P11 += q11;
+		}
+
+		x_p.row(t) = x;
+		v_p.row(t) = v;
+		P00_p.row(t) = P00;
+		P01_p.row(t) = P01;
+		P11_p.row(t) = P11;
+
+		o_row y = o.row(t).array() - x;
+		y[M::a_idx] = remainder(y[M::a_idx], 2*M_PI);
+		o_row S = P00 + r;
+
+		if (t > 0 && this->smooth_gate > 0 && (y.square()/S > this->smooth_gate*this->smooth_gate).any()) {
+			this->obs_outlier[k][t] = true;
+			n_outliers += 1;
+		}
+		else {
+			o_row K0 = P00/S;
+			o_row K1 = P01/S;
+			x += K0*y;
+			v += K1*y;
+			P11 -= K1*P01;
+			P01 *= 1 - K0;
+			P00 *= 1 - K0;
+		}
+
+		x_f.row(t) = x;
+		v_f.row(t) = v;
+		P00_f.row(t) = P00;
+		P01_f.row(t) = P01;
+		P11_f.row(t) = P11;
+	}
+
+	// rts, G = P_f F^T P_p(t+1)^-1 with F = [1 dt; 0 1], only the means are smoothed
+	for (int t = N - 2; t >= 0; t--) {
+		o_row A00 = P00_f.row(t) + dt*P01_f.row(t);
+		o_row A10 = P01_f.row(t) + dt*P11_f.row(t);
+		o_row A01 = P01_f.row(t);
+		o_row A11 = P11_f.row(t);
+
+		o_row det = P00_p.row(t+1)*P11_p.row(t+1) - P01_p.row(t+1).square();
+		o_row I00 = P11_p.row(t+1)/det;
+		o_row I01 = -P01_p.row(t+1)/det;
+		o_row I11 = P00_p.row(t+1)/det;
+
+		o_row dx = x_f.row(t+1) - x_p.row(t+1);
+		o_row dv = v_f.row(t+1) - v_p.row(t+1);
+
+		x_f.row(t) += (A00*I00 + A01*I01)*dx + (A00*I01 + A01*I11)*dv;
+		v_f.row(t) += (A10*I00 + A11*I01)*dx + (A10*I01 + A11*I11)*dv;
+	}
+
+	// same layout as prep_values, outputs and their differences per sample
+	for (int t = 0; t < N; t++) {
+		for (int i = 0; i < M::o_dim; i++) {
+			this->state_est[k]->operator()(t, i) = x_f(t, i);
+
+			if (i < M::s_dim - M::o_dim) {
+				this->state_est[k]->operator()(t, i + M::o_dim) = dt*v_f(t, i);
+			}
+		}
+
+		// the filtered angle is continuous, it is moved to the branch of its observation
+		// as Obs_res does not wrap, logged angles may be unwrapped beyond pi
+		double &a = this->state_est[k]->operator()(t, M::a_idx);
+		a = o(t, M::a_idx) + remainder(a - o(t, M::a_idx), 2*M_PI);
+	}
+
+	return n_outliers;
+}
+
+template<typename M>
+void Model_ident<M>::save_checkpoint(const string &file, const vector<string> &names)
+{
+	// binary: s_dim, p_dim, trajectories, param_est, then for every trajectory
+	// its name, state, parameter shift and spline control point rows
+	ofstream out(file, ios::binary);
+	int dims[3] = {M::s_dim, M::p_dim, (int)this->state_est.size()};
+	out.write((char *)dims, sizeof(dims));
+	out.write((char *)this->param_est.data(), sizeof(double)*M::p_dim);
+
+	for (int k = 0; k < this->state_est.size(); k++) {
+		int len = names[k].size();
+		out.write((char *)&len, sizeof(int));
+		out.write(names[k].data(), len);
+
+		int rows[3] = {
+			(int)this->state_est[k]->rows(),
+			k < this->param_shift_est.size() ? (int)this->param_shift_est[k]->rows() : 0,
+			k < this->ctrl_est.size() ? (int)this->ctrl_est[k]->rows() : 0};
+		out.write((char *)rows, sizeof(rows));
+
+		out.write((char *)this->state_est[k]->data(), sizeof(double)*rows[0]*M::s_dim);
+		if (rows[1] > 0)
+			out.write((char *)this->param_shift_est[k]->data(), sizeof(double)*rows[1]*M::p_dim);
+		if (rows[2] > 0)
+			out.write((char *)this->ctrl_est[k]->data(), sizeof(double)*rows[2]*M::s_dim);
+	}
+}
+
+template<typename M>
+int Model_ident<M>::load_checkpoint(const string &file, const vector<string> &names)
+{
+	// warm start from a checkpoint, call after build_problem, trajectories are matched 
+	// by name and size, the others keep the prepared values, returns number of matched
+	ifstream in(file, ios::binary);
+	if (!in.good())
+		return 0;
+
+	int dims[3];
+	in.read((char *)dims, sizeof(dims));
+	if (!in.good() || dims[0] != M::s_dim || dims[1] != M::p_dim) {
+		cerr << "checkpoint " << file << " does not match the model" << endl;
+		return 0;
+	}
+
+	p_vec p;
+	in.read((char *)p.data(), sizeof(double)*M::p_dim);
+
+	map<string, int> idx;
+	for (int k = 0; k < names.size(); k++)
+		idx[names[k]] = k;
+
+	int matched = 0;
+	int ctrl_missing = 0;
+	string name;
+	s_mat s, ctrl;
+	p_mat p_shift;
+	for (int j = 0; j < dims[2]; j++) {
+		int len;
+		in.read((char *)&len, sizeof(int));
+		name.resize(len);
+		in.read(&name[0], len);
+
+		int rows[3];
+		in.read((char *)rows, sizeof(rows));
+		s.resize(rows[0], M::s_dim);
+		p_shift.resize(rows[1], M::p_dim);
+		ctrl.resize(rows[2], M::s_dim);
+		in.read((char *)s.data(), sizeof(double)*rows[0]*M::s_dim);
+		in.read((char *)p_shift.data(), sizeof(double)*rows[1]*M::p_dim);
+		in.read((char *)ctrl.data(), sizeof(double)*rows[2]*M::s_dim);
+
+		if (!in.good()) {
+			cerr << "checkpoint " << file << " is truncated" << endl;
+			break;
+		}
+
+		auto it = idx.find(name);
+		if (it == idx.end() || this->state_est[it->second]->rows() != rows[0])
+			continue;
+
+		int k = it->second;
+		*(this->state_est[k]) = s;
+		if (k < this->param_shift_est.size() && this->param_shift_est[k]->rows() == rows[1])
+			*(this->param_shift_est[k]) = p_shift;
+		if (k < this->ctrl_est.size() && this->ctrl_est[k]->rows() == rows[2]) {
+			*(this->ctrl_est[k]) = ctrl;
+		}
+		else if (k < this->ctrl_est.size()) {
+			// spline_spacing changed, control points start at the loaded states
+			this->spline_init(k);
+			ctrl_missing += 1;
+		}
+
+		matched += 1;
+	}
+
+	if (ctrl_missing > 0) {
+		cerr << "checkpoint " << file << " has no control points for spline_spacing " << this->spline_spacing
+			<< ", " << ctrl_missing << " trajectories start from the control points of the loaded states" << endl;
+	}
+
+	if (matched > 0)
+		this->param_est = p.cwiseMax(this->param_lb).cwiseMin(this->param_ub);
+
+	return matched;
+}
+
+template<typename M>
+double Model_ident<M>::rollout_sse(int k, const p_vec &p, int u_delay, int t0, int n_steps, int &n)
+{
+	// euler rollout of the state eq from the prepared state at t0,
+	// returns the sum of squared output errors, n is increased by the number of outputs
+	s_vec s = this->state_est[k]->row(t0).transpose();
+	s_vec ds;
+	o_vec o;
+	const double *u;
+	double sse = 0;
+
+	for (int t = t0; t < t0 + n_steps; t++) {
+		u = this->delayed_input(k, t, u_delay);
+
+		M::state_eq(ds.data(), s.data(), u, p.data());
+		s += this->dt*ds;
+
+		M::output_eq(o.data(), s.data());
+		sse += (o - this->pos_data[k]->row(t + 1).transpose()).squaredNorm();
+		n += M::o_dim;
+	}
+
+	return sse;
+}
+
+template<typename M>
+Eigen::MatrixXd Model_ident<M>::cross_validate(int n_folds, int u_delay, int horizon)
+{
+	// every fold is solved by its own instance sharing the trajectory data,
+	// held-out trajectories are scored from the prepared states of this instance,
+	// call before solving, metrics row: final cost, open-loop rmse, n-step rmse, parameters
+	Eigen::MatrixXd metrics(n_folds, 3 + M::p_dim);
+	atomic<int> next = 0;
+
+	int n_threads = this->cv_threads;
+	if (n_threads <= 0)
+		n_threads = max(1, (int)thread::hardware_concurrency());
+	n_threads = min(n_threads, n_folds);
+
+	vector<thread> workers;
+	int solver_threads = max(1, this->solver_options.num_threads/n_threads);
+	for (int i = 0; i < n_threads; i++)
+		workers.push_back(thread(&Model_ident<M>::cv_worker, this, &metrics, &next, u_delay, horizon, solver_threads));
+
+	for (auto &w : workers)
+		w.join();
+
+	return metrics;
+}
+
+template<typename M>
+void Model_ident<M>::cv_worker(Eigen::MatrixXd *metrics, atomic<int> *next, int u_delay, int horizon, int solver_threads)
+{
+	const int K = this->pos_data.size();
+	const int n_folds = metrics->rows();
+	Solver::Summary summary;
+
+	for (int f = (*next)++; f < n_folds; f = (*next)++) {
+		vector<int> train_idx;
+		vector<int> test_idx;
+		for (int k = 0; k < K; k++) {
+			if (k % n_folds == f)
+				test_idx.push_back(k);
+			else
+				train_idx.push_back(k);
+		}
+
+		Model_ident<M> fold;
+		fold.set_config(this->config);
+		fold.solver_options.minimizer_progress_to_stdout = false;
+		fold.solver_options.num_threads = solver_threads;
+		fold.share_trajectories(*this, train_idx);
+		fold.build_problem(u_delay);
+		fold.solve(&summary);
+
+		double open_sse = 0, step_sse = 0;
+		int open_n = 0, step_n = 0;
+		for (int k : test_idx) {
+			int N = this->pos_data[k]->rows();
+			open_sse += this->rollout_sse(k, fold.param_est, u_delay, 0, N - 1, open_n);
+			for (int t = 0; t + horizon < N; t++)
+				step_sse += this->rollout_sse(k, fold.param_est, u_delay, t, horizon, step_n);
+		}
+
+		(*metrics)(f, 0) = summary.final_cost;
+		(*metrics)(f, 1) = sqrt(open_sse/max(open_n, 1));
+		(*metrics)(f, 2) = sqrt(step_sse/max(step_n, 1));
+		metrics->row(f).tail<M::p_dim>() = fold.param_est;
+
+		cerr << "fold " << f + 1 << "/" << n_folds << " par est " << fold.param_est.transpose() << endl;
+	}
+}
+
 template<typename M>
 void Model_ident<M>::set_config(json config)
 {
+	this->config = config;
 	this->dt = config["dt"];
 
 	if (!config["p_lb"].is_null()) {
@@ -473,28 +1817,151 @@ void Model_ident<M>::set_config(json config)
 
 	this->C_o = array_to_vector(config["C_o"]);
 	this->C_s = array_to_vector(config["C_s"]);
-	this->C_prior = array_to_vector(config["C_prior"]);
+	if (config["C_prior"].is_number())
+		this->C_prior.setConstant(config["C_prior"]); // same weight for all parameters
+	else
+		this->C_prior = array_to_vector(config["C_prior"]);
 
 	if (!config["use_param_shift"].is_null()) {
 		this->use_param_shift = config["use_param_shift"];
 		if (this->use_param_shift) {
-			this->C_o = array_to_vector(config["C_shift_global"]);
-			this->C_s = array_to_vector(config["C_shift_diff"]);
+			this->C_shift_global = array_to_vector(config["C_shift_global"]);
+			this->C_shift_diff = array_to_vector(config["C_shift_diff"]);
 		}
 	}
 
-	else {
-		this->C_prior.setConstant(config["C_prior"]);
+	if (!config["param_shift_segment"].is_null()) {
+		this->param_shift_segment = max(1, (int)config["param_shift_segment"]);
 	}
 
 	if (!config["obs_loss_s"].is_null()) {
 		this->obs_loss_s = config["obs_loss_s"];
 	}
 
+	if (!config["spline_spacing"].is_null()) {
+		this->spline_spacing = config["spline_spacing"];
+	}
+
 	if (!config["state_loss_s"].is_null()) {
 		this->state_loss_s = config["state_loss_s"];
 	}
 
+	if (!config["bootstrap_threads"].is_null()) {
+		this->bootstrap_threads = config["bootstrap_threads"];
+	}
+
+	if (!config["bootstrap_seed"].is_null()) {
+		this->bootstrap_seed = config["bootstrap_seed"];
+	}
+
+	if (!config["cv_threads"].is_null()) {
+		this->cv_threads = config["cv_threads"];
+	}
+
+	if (!config["delay_threads"].is_null()) {
+		this->delay_threads = config["delay_threads"];
+	}
+
+	if (!config["admm_shards"].is_null()) {
+		this->admm_shards = config["admm_shards"];
+	}
+
+	if (!config["admm_threads"].is_null()) {
+		this->admm_threads = config["admm_threads"];
+	}
+
+	if (!config["admm_max_iter"].is_null()) {
+		this->admm_max_iter = config["admm_max_iter"];
+	}
+
+	if (!config["admm_rho"].is_null()) {
+		this->admm_rho = config["admm_rho"];
+	}
+
+	if (!config["admm_tol"].is_null()) {
+		this->admm_tol = config["admm_tol"];
+	}
+
+	if (!config["sgd_iter"].is_null()) {
+		this->sgd_iter = config["sgd_iter"];
+	}
+
+	if (!config["sgd_batch"].is_null()) {
+		this->sgd_batch = config["sgd_batch"];
+	}
+
+	if (!config["sgd_window"].is_null()) {
+		this->sgd_window = config["sgd_window"];
+	}
+
+	if (!config["sgd_threads"].is_null()) {
+		this->sgd_threads = config["sgd_threads"];
+	}
+
+	if (!config["sgd_seed"].is_null()) {
+		this->sgd_seed = config["sgd_seed"];
+	}
+
+	if (!config["sgd_lr"].is_null()) {
+		this->sgd_lr = config["sgd_lr"];
+	}
+
+	if (!config["sgd_momentum"].is_null()) {
+		this->sgd_momentum = config["sgd_momentum"];
+	}
+
+	if (!config["sgd_C_prox"].is_null()) {
+		this->sgd_C_prox = config["sgd_C_prox"];
+	}
+
+	if (!config["sgd_average"].is_null()) {
+		this->sgd_average = config["sgd_average"];
+	}
+
+	if (!config["multistart_starts"].is_null()) {
+		this->multistart_starts = config["multistart_starts"];
+	}
+
+	if (!config["multistart_keep"].is_null()) {
+		this->multistart_keep = config["multistart_keep"];
+	}
+
+	if (!config["multistart_iter"].is_null()) {
+		this->multistart_iter = config["multistart_iter"];
+	}
+
+	if (!config["multistart_threads"].is_null()) {
+		this->multistart_threads = config["multistart_threads"];
+	}
+
+	if (!config["multistart_seed"].is_null()) {
+		this->multistart_seed = config["multistart_seed"];
+	}
+
+	if (!config["u_delay_shift"].is_null()) {
+		this->u_delay_shift = config["u_delay_shift"];
+	}
+
+	if (!config["smooth_init"].is_null()) {
+		this->smooth_init = config["smooth_init"];
+	}
+
+	if (!config["smooth_threads"].is_null()) {
+		this->smooth_threads = config["smooth_threads"];
+	}
+
+	if (!config["smooth_gate"].is_null()) {
+		this->smooth_gate = config["smooth_gate"];
+	}
+
+	if (!config["smooth_acc_sd"].is_null()) {
+		this->smooth_acc_sd = array_to_vector(config["smooth_acc_sd"]);
+	}
+
+	if (!config["delay_score"].is_null()) {
+		this->delay_score_cost = string(config["delay_score"]).compare("cost") == 0;
+	}
+
 	if (!config["solver_max_iter"].is_null()) {
 		this->solver_options.max_num_iterations = config["solver_max_iter"];
 	}
@@ -538,6 +2005,29 @@ void Model_ident<M>::set_config(json config)
 			this->solver_options.linear_solver_type = ceres::SPARSE_SCHUR;
 			cerr << "using sparse schur" << endl;
 		}
+		else if (string(config["solver_linear_solver_type"]).compare("iterative_schur") == 0) {
+			this->solver_options.linear_solver_type = ceres::ITERATIVE_SCHUR;
+			cerr << "using iterative schur" << endl;
+		}
+	}
+
+	if (!config["solver_preconditioner"].is_null()) {
+		if (string(config["solver_preconditioner"]).compare("identity") == 0) {
+			this->solver_options.preconditioner_type = ceres::IDENTITY;
+		}
+		else if (string(config["solver_preconditioner"]).compare("jacobi") == 0) {
+			this->solver_options.preconditioner_type = ceres::JACOBI;
+		}
+		else if (string(config["solver_preconditioner"]).compare("schur_jacobi") == 0) {
+			this->solver_options.preconditioner_type = ceres::SCHUR_JACOBI;
+		}
+		else if (string(config["solver_preconditioner"]).compare("cluster_jacobi") == 0) {
+			this->solver_options.preconditioner_type = ceres::CLUSTER_JACOBI;
+		}
+		else if (string(config["solver_preconditioner"]).compare("cluster_tridiagonal") == 0) {
+			this->solver_options.preconditioner_type = ceres::CLUSTER_TRIDIAGONAL;
+		}
+		cerr << "using " << string(config["solver_preconditioner"]) << " preconditioner" << endl;
 	}
 	
 }
@@ -177,8 +177,26 @@ public:
 
 	~MPC_controller()
 	{
-		delete this->u_arr;
+		this->delete_problem();
+		delete[] this->u_arr;
+	}
+
+	void delete_problem()
+	{
+		// cost functions are owned here, residual blocks are removed and added again
 		delete this->problem;
+		this->problem = nullptr;
+
+		for (auto cost_fun : this->action_cost)
+			delete cost_fun;
+		for (auto cost_fun : this->target_cost)
+			delete cost_fun;
+
+		this->action_cost.clear();
+		this->target_cost.clear();
+		this->target_blocks.clear();
+		this->action_id.clear();
+		this->target_id.clear();
 	}
 	void shift_u_arr(int t)
 	{
@@ -187,69 +205,96 @@ public:
 
 	void zero_u_arr()
 	{
-		memset(this->u_arr, 0, M::u_dim*this->h*sizeof(double));
+		memset(this->u_arr, 0, M::u_dim*this->arena_h*sizeof(double));
 	}
 
 	void build_problem()
 	{
-		delete this->problem; // nothing happens for fresh, nullptr
-		this->problem = new Problem();
+		// terms of the whole arena are created once, the ones past the horizon
+		// are not in the problem, u_arr is reallocated only if h does not fit
+		int n = max(this->h, this->max_h);
+		if (this->u_arr == nullptr || n > this->arena_h) {
+			delete[] this->u_arr;
+			this->u_arr = new double[M::u_dim*n];
+			this->arena_h = n;
+		}
+
+		this->delete_problem(); // nothing happens for fresh, nullptr
+
+		Problem::Options problem_options;
+		problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+		problem_options.enable_fast_removal = true;
+		this->problem = new Problem(problem_options);
 
 		this->u0.setZero();
-		this->u_arr = new double[M::u_dim*this->h];
 		this->zero_u_arr();
 		
 		this->u.clear();
-		for (int t = 0; t < this->h; t++) {
+		for (int t = 0; t < this->arena_h; t++) {
 			this->u.push_back(this->u_arr + t*M::u_dim);
 		}
 
-		double *C_ptr;
-		vector<double*> parameter_blocks;
+		this->target_C.resize(this->arena_h, M::s_dim);
+		this->target_blocks.resize(this->arena_h);
 
-		for (int t = 0; t < this->h; t++) {
-			if (this->use_u_diff) {
-				if (t == 0) {
-					CostFunction *action_cost_fun = First_action_diff_term<M>::Create(this->u0.data(), this->C_u.data());
-					problem->AddResidualBlock(action_cost_fun, nullptr, this->u[t]);
-				}
-				else {
-					CostFunction *action_cost_fun = Action_diff_term<M>::Create(this->C_u.data());
-					problem->AddResidualBlock(action_cost_fun, nullptr, this->u[t-1], this->u[t]);
-				}
-			}
-			else {
-				CostFunction *action_cost_fun = Action_term<M>::Create(this->C_u.data());
-				problem->AddResidualBlock(action_cost_fun, nullptr, this->u[t]);
-			}
+		for (int t = 0; t < this->arena_h; t++) {
+			if (this->use_u_diff && t == 0)
+				this->action_cost.push_back(First_action_diff_term<M>::Create(this->u0.data(), this->C_u.data()));
+			else if (this->use_u_diff)
+				this->action_cost.push_back(Action_diff_term<M>::Create(this->C_u.data()));
+			else
+				this->action_cost.push_back(Action_term<M>::Create(this->C_u.data()));
+
+			// weights of the last target are set by the active horizon
+			this->target_cost.push_back(Target_term<M>::Create(
+				this->s0.data(), 
+				this->s_tar.data(), 
+				this->p.data(),
+				t, dt, this->target_C.row(t).data(),
+				&this->u,
+				&this->target_blocks[t]));
 
+			this->problem->AddParameterBlock(this->u[t], M::u_dim);
 			for (int i = 0; i < M::u_dim; i++) {
-				problem->SetParameterLowerBound(this->u[t], i, this->u_lb[i]);
-				problem->SetParameterUpperBound(this->u[t], i, this->u_ub[i]);
+				this->problem->SetParameterLowerBound(this->u[t], i, this->u_lb[i]);
+				this->problem->SetParameterUpperBound(this->u[t], i, this->u_ub[i]);
 			}
+			this->problem->SetParameterBlockConstant(this->u[t]);
 		}
 
-		for (int t = 0; t < this->h; t++) {
-			
-			if (t < this->h - 1) {
-				C_ptr = this->C_s.data();
+		this->action_id.assign(this->arena_h, nullptr);
+		this->target_id.assign(this->arena_h, nullptr);
+		this->active_h = 0;
+		this->activate(this->h);
+	}
+
+	void activate(int h_)
+	{
+		// adds the terms of steps active_h..h_ or removes the terms of h_..active_h
+		for (int t = min(h_, this->active_h); t < max(h_, this->active_h); t++) {
+			if (t < h_) {
+				if (this->use_u_diff && t > 0)
+					this->action_id[t] = this->problem->AddResidualBlock(this->action_cost[t], nullptr, this->u[t-1], this->u[t]);
+				else
+					this->action_id[t] = this->problem->AddResidualBlock(this->action_cost[t], nullptr, this->u[t]);
+
+				this->target_id[t] = this->problem->AddResidualBlock(this->target_cost[t], nullptr, this->target_blocks[t]);
+				this->problem->SetParameterBlockVariable(this->u[t]);
 			}
 			else {
-				C_ptr = this->C_s_end.data();
+				this->problem->RemoveResidualBlock(this->action_id[t]);
+				this->problem->RemoveResidualBlock(this->target_id[t]);
+				this->action_id[t] = nullptr;
+				this->target_id[t] = nullptr;
+				this->problem->SetParameterBlockConstant(this->u[t]);
 			}
-
-			typename Target_term<M>::Target_cost_fun *target_cost_fun = Target_term<M>::Create(
-				this->s0.data(), 
-				this->s_tar.data(), 
-				this->p.data(),
-				t, dt, C_ptr,
-				&this->u,
-				&parameter_blocks);
-
-			problem->AddResidualBlock(target_cost_fun, nullptr, parameter_blocks);				
 		}
 
+		for (int t = 0; t < h_; t++) {
+			this->target_C.row(t) = (t < h_ - 1 ? this->C_s : this->C_s_end).transpose();
+		}
 
+		this->active_h = h_;
 	}
 
 	void solve_problem(s_vec &s0_, u_vec& u0_, s_vec &s_tar_, p_vec &p_)
@@ -271,6 +316,19 @@ public:
 		}
 	}
 
+	void set_horizon(int h_)
+	{
+		// residual blocks are toggled, the problem is kept, inputs past the
+		// old horizon continue its last input as the warm start
+		assert(h_ > 0 && h_ <= this->arena_h);
+		for (int t = this->h; t < h_; t++) {
+			memcpy(this->u[t], this->u[this->h - 1], M::u_dim*sizeof(double));
+		}
+
+		this->activate(h_);
+		this->h = h_;
+	}
+
 	u_vec u_vector(int t) 
 	{
 		return array_to_vector<M::u_dim>(this->u[t]);
@@ -280,6 +338,8 @@ public:
 
 	double dt;
 	int h; // horizon
+	int max_h = 0; // u_arr is sized for at least this horizon
+	int arena_h = 0; // horizon u_arr is sized for
 	bool use_u_diff = false;
 
 	s_vec s0;
@@ -297,6 +357,15 @@ public:
 	double *u_arr = nullptr;
 	vector<double *>u;
 
+	// terms of every step of the arena, ids of the ones in the problem
+	vector<CostFunction *> action_cost;
+	vector<CostFunction *> target_cost;
+	vector<vector<double *>> target_blocks;
+	vector<ResidualBlockId> action_id;
+	vector<ResidualBlockId> target_id;
+	Eigen::Matrix<double, -1, M::s_dim, Eigen::RowMajor> target_C; // weights of the targets
+	int active_h = 0; // steps with terms in the problem
+
 	Problem *problem = nullptr;
 	Solver::Summary solver_summary;
 	Solver::Options solver_options;
@@ -309,6 +378,10 @@ void MPC_controller<M>::set_config(json config)
 	this->dt = config["dt"];
 	this->h = config["h"];
 
+	if (!config["max_h"].is_null()) {
+		this->max_h = config["max_h"];
+	}
+
 	this->C_s = array_to_vector(config["C_s"]);
 	this->C_s_end = array_to_vector(config["C_s_end"]);
 	this->C_u = array_to_vector(config["C_u"]);
@@ -395,6 +468,8 @@ public:
 		s_vec s_tar;
 		p_vec p;
 
+		int h = 0; // requested horizon, 0 keeps the current one
+
 		mutex mtx;
 		condition_variable cv;
 	};
@@ -418,7 +493,7 @@ public:
 	{
 		this->end();
 
-		delete this->sol.u_arr;
+		delete[] this->sol.u_arr;
 	}
 
 	void post_request(int ts, s_vec s0, u_vec u0, s_vec s_tar, p_vec p)
@@ -434,6 +509,17 @@ public:
 		rqst_lck.unlock();
 	}
 
+	void set_horizon(int h_)
+	{
+		// applied by the handler thread before the next solve
+		unique_lock<mutex> rqst_lck(this->rqst.mtx);
+		if (h_ > this->ctrl.arena_h) {
+			cerr << "MPC horizon " << h_ << " exceeds max_h " << this->ctrl.arena_h << endl;
+			h_ = this->ctrl.arena_h;
+		}
+		this->rqst.h = h_;
+	}
+
 	void start();
 
 	void end()
@@ -453,7 +539,7 @@ public:
 
 		
 		this->sol.ts = -1;
-		memset(this->sol.u_arr, 0, M::u_dim*this->h*sizeof(double));
+		memset(this->sol.u_arr, 0, M::u_dim*this->ctrl.arena_h*sizeof(double));
 		this->ctrl.zero_u_arr();
 	}
 
@@ -549,6 +635,13 @@ void mpc_handler_func(MPC_handler<M> * hndl)
 
 		p = hndl->rqst.p;
 
+		if (hndl->rqst.h > 0 && hndl->rqst.h != hndl->ctrl.h) {
+			hndl->ctrl.set_horizon(hndl->rqst.h);
+
+			unique_lock<mutex> sol_lck(hndl->sol.mtx);
+			hndl->h = hndl->ctrl.h;
+		}
+
 		rqst_lck.unlock();
 
 		// hndl->ctrl.shift_u_arr(ts - hndl->sol.ts);
@@ -574,11 +667,11 @@ template<typename M>
 void MPC_handler<M>::start()
 {
 	if (this->sol.u_arr ==  nullptr)
-		this->sol.u_arr = new double[M::u_dim*this->h];
+		this->sol.u_arr = new double[M::u_dim*this->ctrl.arena_h]; // sized once for the largest horizon
 	
 	
 	this->sol.u.clear();
-	for (int t = 0; t < this->h; t++) {
+	for (int t = 0; t < this->ctrl.arena_h; t++) {
 		this->sol.u.push_back(this->sol.u_arr + t*M::u_dim);
 	}
 
@@ -0,0 +1,127 @@
+#ifndef __RESIDUALS_HPP__
+#define __RESIDUALS_HPP__
+
+#include <ceres/ceres.h>
+
+using namespace ceres;
+
+// residuals shared by the identification, the MHE and the incremental smoother
+
+template<int S>
+struct Prior_res
+{
+	Prior_res(const double *x_p, const double *C) :
+		x_p(x_p), C(C) {}
+	
+	template <typename T>
+	bool operator()(const T* const x, T* residual) const
+	{
+		
+		for (int i = 0; i < S; i++)
+			residual[i] = C[i]*(x[i] - this->x_p[i]);
+
+		return true;
+	}
+
+	static CostFunction* Create(const double *x_p, const double *C)
+	{
+		return (new AutoDiffCostFunction<Prior_res<S>, S, S>(new Prior_res<S>(x_p, C)));
+	}
+
+	const double *x_p;
+	const double *C; // cost multiplier
+};
+
+template<typename M>
+struct Obs_mhe_res
+{
+	Obs_mhe_res(const double *obs, const double *C, double *w) :
+		obs(obs), C(C), w(w) {}
+	
+	template <typename T>
+	bool operator()(const T* const s, T* residual) const 
+	{
+		T o[M::o_dim];
+		M::output_eq(o, s);
+
+		for (int i = 0; i < M::o_dim; i++) {
+			residual[i] = this->w[0]*this->C[i]*(o[i] - this->obs[i]);
+		}
+
+		return true;
+	}
+
+	static CostFunction* Create(const double *obs, const double *C, double *w) {
+		return (new AutoDiffCostFunction<Obs_mhe_res, M::o_dim, M::s_dim>(new Obs_mhe_res(obs, C, w)));
+	}
+
+	
+	
+	const double *obs;
+	const double *C; // cost multipliers
+	double *w;
+};
+
+template<typename M>
+struct State_mhe_res
+{
+	State_mhe_res(const double *u, const double *dt, const double *C, double *w) :
+		u(u), dt(dt), C(C), w(w) {}
+	
+	template <typename T>
+	bool operator()(const T* const s_curr, const T* const s_next,
+		const T* const p, T* res) const
+	{
+		T ds[M::s_dim];
+		M::state_eq(ds, s_curr, this->u, p);
+
+		for(int i = 0; i < M::s_dim; i++) {
+			res[i] = this->w[0]*this->C[i]*((s_curr[i] - s_next[i])/this->dt[0] + ds[i]);
+		}
+
+		return true;
+	}
+
+
+	static CostFunction* Create(const double* u, const double *dt, const double *C, double *w) {
+		return (new AutoDiffCostFunction<State_mhe_res, M::s_dim, M::s_dim, M::s_dim, M::p_dim>(new State_mhe_res(u, dt, C, w)));
+	}
+
+	const double *u;
+	const double *dt; // time interval of the transition
+	const double *C; // cost multiplier
+	double *w;
+};
+
+template<typename M>
+struct State_mhe_prior_res
+{
+	State_mhe_prior_res(const double *s0, const double *u, const double *dt, const double *C, double *w) :
+		s0(s0), u(u), dt(dt), C(C), w(w) {}
+	
+	template <typename T>
+	bool operator()(const T* const s_next,	const T* const p, T* res) const
+	{
+		T ds[M::s_dim];
+		M::state_eq(ds, this->s0, this->u, p);
+
+		for(int i = 0; i < M::s_dim; i++) {
+			res[i] = this->w[0]*this->C[i]*((this->s0[i] - s_next[i])/this->dt[0] + ds[i]);
+		}
+
+		return true;
+	}
+
+
+	static CostFunction* Create(const double *s0, const double* u, const double *dt, const double *C, double *w) {
+		return (new AutoDiffCostFunction<State_mhe_prior_res, M::s_dim, M::s_dim, M::p_dim>(new State_mhe_prior_res(s0, u, dt, C, w)));
+	}
+
+	const double *s0;
+	const double *u;
+	const double *dt; // time interval of the transition
+	const double *C; // cost multiplier
+	double *w;
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef __RLS_HPP__
+#define __RLS_HPP__
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+
+#include <eigen3/Eigen/Dense>
+
+#include "utils/aux.hpp"
+#include "utils/json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+template<typename M>
+class RLS_handler
+{
+/* streaming identification by recursive least squares with forgetting,
+ * the model has to be linear in theta, ds = phi(s, u)*theta (M::lin_regressor),
+ * observed states are used as states, ds is the difference of observations
+ * over step samples and phi is averaged over the same samples,
+ * each state row is a scalar update, one sample costs O(p^2),
+ * parameters are published as p = M::lin_to_params(theta) clamped to bounds
+ */
+public:
+	typedef typename M::s_vec s_vec;
+	typedef typename M::u_vec u_vec;
+	typedef typename M::o_vec o_vec;
+	typedef typename M::p_vec p_vec;
+
+	typedef typename M::phi_mat phi_mat;
+	typedef Eigen::Matrix<double, M::p_dim, M::p_dim> p_mat;
+
+	static_assert(M::o_dim == M::s_dim, "RLS requires fully observed state");
+
+	struct request
+	{
+		int ts = -1; // timestep
+
+		vector<o_vec> o;
+		vector<u_vec> u;
+		vector<bool> valid;
+
+		mutex mtx;
+		condition_variable cv;
+	};
+
+	struct solution
+	{
+		int ts = -1; // timestep of the last processed sample
+
+		p_vec p;
+
+		mutex mtx;
+	};
+
+	RLS_handler()
+	{
+		this->p_lb = array_to_vector<M::p_dim>(M::p_lb);
+		this->p_ub = array_to_vector<M::p_dim>(M::p_ub);
+		this->p_prior = (this->p_lb + this->p_ub)/2;
+
+		this->C_s.setOnes();
+		this->P0.setIdentity();
+	}
+
+	~RLS_handler()
+	{
+		this->end();
+	}
+
+	bool get_params(p_vec &p_, int t)
+	{
+		// false until the first sample is processed
+		unique_lock<mutex> sol_lck(this->sol.mtx);
+		if (this->sol.ts < 0 || t - this->sol.ts <= 0) {
+			return false;
+		}
+
+		p_ = this->sol.p;
+		return true;
+	}
+
+	void post_request(const int ts, const o_vec &o_, const u_vec &u_, const bool valid=true)
+	{
+		// u_ is the input applied at ts, including the delay
+		unique_lock<mutex> rqst_lck(this->rqst.mtx);
+		this->rqst.ts = ts;
+
+		this->rqst.o.push_back(o_);
+		this->rqst.u.push_back(u_);
+		this->rqst.valid.push_back(valid);
+
+		this->rqst.cv.notify_one();
+	}
+
+	bool update(const o_vec &o_, const u_vec &u_, const bool valid)
+	{
+		// adds one sample, returns true if theta was updated
+		int n_buf = this->step + 1;
+		int idx = this->n % n_buf;
+
+		this->o_buf[idx] = o_;
+		this->u_buf[idx] = u_;
+		this->valid_buf[idx] = valid;
+		this->n += 1;
+
+		if (this->n < n_buf)
+			return false;
+
+		int first = this->n % n_buf; // oldest sample in the buffer
+		for (int k = 0; k < n_buf; k++) {
+			if (!this->valid_buf[k])
+				return false; // regressor or difference would use a missing sample
+		}
+
+		phi_mat phi, phi_k;
+		phi.setZero();
+		for (int k = 0; k < this->step; k++) {
+			int i = (first + k) % n_buf;
+			M::lin_regressor(phi_k, this->o_buf[i], this->u_buf[i]);
+			phi += phi_k/this->step;
+		}
+
+		s_vec y = (o_ - this->o_buf[first])/(this->step*this->dt);
+		if (M::a_idx >= 0) {
+			double da = o_[M::a_idx] - this->o_buf[first][M::a_idx];
+			y[M::a_idx] = remainder(da, 2*M_PI)/(this->step*this->dt); // angle wraps around
+		}
+
+		if (this->P.trace() < this->P0.trace()) // no forgetting without excitation
+			this->P /= this->forgetting;
+
+		for (int i = 0; i < M::s_dim; i++) {
+			p_vec h = phi.row(i).transpose();
+			p_vec Ph = this->P*h;
+			double s = 1/(this->C_s[i]*this->C_s[i]) + h.dot(Ph);
+			p_vec k = Ph/s;
+
+			this->theta += k*(y[i] - h.dot(this->theta));
+			this->P -= k*Ph.transpose();
+		}
+
+		return true;
+	}
+
+	p_vec p_vector()
+	{
+		p_vec p = M::lin_to_params(this->theta);
+		for (int i = 0; i < M::p_dim; i++) {
+			p[i] = min(max(p[i], this->p_lb[i]), this->p_ub[i]);
+		}
+
+		return p;
+	}
+
+	void start();
+
+	void end()
+	{
+		if (this->done == false) {
+			this->done = true;
+			this->rqst.cv.notify_one();
+			this->hndl_thread.join();
+		}
+	}
+
+	void reset()
+	{
+		unique_lock<mutex> sol_lck(this->sol.mtx);
+		unique_lock<mutex> rqst_lck(this->rqst.mtx);
+		this->sol.ts = -1;
+		this->sol.p = this->p_prior;
+
+		this->rqst.ts = -1;
+		this->rqst.o.clear();
+		this->rqst.u.clear();
+		this->rqst.valid.clear();
+
+		this->n = 0;
+		this->o_buf.assign(this->step + 1, o_vec::Zero());
+		this->u_buf.assign(this->step + 1, u_vec::Zero());
+		this->valid_buf.assign(this->step + 1, false);
+
+		this->theta = M::params_to_lin(this->p_prior);
+		this->P = this->P0;
+	}
+
+	void set_config(json config);
+
+	double dt;
+	int step = 1; // samples in one difference
+	double forgetting = 0.998;
+
+	p_vec theta;
+	p_mat P;
+	p_mat P0;
+	s_vec C_s; // weights of ds
+
+	p_vec p_prior;
+	p_vec p_lb;
+	p_vec p_ub;
+
+	int n = 0; // samples added
+	vector<o_vec> o_buf;
+	vector<u_vec> u_buf;
+	vector<bool> valid_buf;
+
+	solution sol;
+	request rqst;
+
+	atomic<bool> done = true;
+	thread hndl_thread;
+};
+
+template<typename M>
+void rls_handler_func(RLS_handler<M> *hndl)
+{
+	cerr << "starting rls handler thread" << endl;
+
+	vector<typename M::o_vec> o;
+	vector<typename M::u_vec> u;
+	vector<bool> valid;
+
+	int ts;
+	while (!hndl->done)
+	{
+		unique_lock<mutex> rqst_lck(hndl->rqst.mtx);
+		if (hndl->rqst.o.empty() && !hndl->done) {
+			hndl->rqst.cv.wait(rqst_lck);
+		}
+		if (hndl->done) {
+			rqst_lck.unlock();
+			break;
+		}
+		if (hndl->rqst.o.empty()) {
+			rqst_lck.unlock();
+			continue;
+		}
+
+		ts = hndl->rqst.ts;
+		o.swap(hndl->rqst.o);
+		u.swap(hndl->rqst.u);
+		valid.swap(hndl->rqst.valid);
+		rqst_lck.unlock();
+
+		bool updated = false;
+		for (int k = 0; k < o.size(); k++) {
+			updated |= hndl->update(o[k], u[k], valid[k]);
+		}
+
+		o.clear();
+		u.clear();
+		valid.clear();
+
+		if (!updated)
+			continue;
+
+		typename M::p_vec p = hndl->p_vector();
+
+		unique_lock<mutex> sol_lck(hndl->sol.mtx);
+		hndl->sol.ts = ts;
+		hndl->sol.p = p;
+		sol_lck.unlock();
+	}
+
+	cerr << "ending rls handler thread" << endl;
+}
+
+template<typename M>
+void RLS_handler<M>::start()
+{
+	this->reset();
+	this->done = false;
+	this->hndl_thread = thread(rls_handler_func<M>, this);
+}
+
+template<typename M>
+void RLS_handler<M>::set_config(json config)
+{
+	this->dt = config["dt"];
+
+	if (!config["p_lb"].is_null()) {
+		this->p_lb = array_to_vector(config["p_lb"]);
+	}
+
+	if (!config["p_ub"].is_null()) {
+		this->p_ub = array_to_vector(config["p_ub"]);
+	}
+
+	this->p_prior = (this->p_lb + this->p_ub)/2;
+
+	if (!config["p_prior"].is_null()) {
+		this->p_prior = array_to_vector(config["p_prior"]);
+	}
+
+	if (!config["C_s"].is_null()) {
+		this->C_s = array_to_vector(config["C_s"]);
+	}
+
+	if (!config["rls_step"].is_null()) {
+		this->step = config["rls_step"];
+	}
+
+	if (!config["rls_forgetting"].is_null()) {
+		this->forgetting = config["rls_forgetting"];
+	}
+
+	this->P0.setIdentity();
+	if (!config["rls_C_prior"].is_null()) {
+		p_vec C_p = array_to_vector(config["rls_C_prior"]);
+		for (int i = 0; i < M::p_dim; i++) {
+			this->P0(i, i) = 1/(C_p[i]*C_p[i]);
+		}
+	}
+
+	this->reset();
+}
+
+#endif
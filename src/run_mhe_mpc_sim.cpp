@@ -76,7 +76,7 @@ int main(int argc, char const *argv[])
 
 	MHE_handler<M> mhe;
 	mhe.set_config(mhe_config);
-	mhe.estim.build_problem();
+	mhe.build_problem();
 	
 
 	M::o_vec obs;
@@ -149,7 +149,7 @@ int main(int argc, char const *argv[])
 			}
 			state_pred = M::predict_state(s_est, u_buffer, p_est, dt);
 			mpc.post_request(t + 1, state_pred, u_buffer.back(), target, p_est);
-			mhe.post_request(t, obs, u_buffer.front());
+			mhe.post_request(t, obs, u_buffer.front(), -1, sim.o_valid);
 
 			// auto mpc_start = chrono::high_resolution_clock::now();
 			// mpc.ctrl.solve_problem(pos_pred, target, mpc_p);
@@ -22,6 +22,42 @@ using json = nlohmann::json;
 
 string default_config = "/home/jsv/CVUT/master-thesis/config/ident_sim_simple.json";
 
+template<typename T>
+void decimate(T &x, int factor, int angle_col=-1)
+{
+	// zero-phase windowed sinc low-pass with cutoff at 0.8 of the new nyquist,
+	// then every factor-th row is kept, samples past the ends repeat the end values,
+	// the angle column is unwrapped before filtering and stays unwrapped,
+	// the identification does not wrap angles
+	int N = x.rows();
+	int h = 4*factor; // half length of the filter
+	double fc = 0.4/factor; // cycles per sample
+
+	vector<double> w(2*h + 1);
+	double w_sum = 0;
+	for (int j = -h; j <= h; j++) {
+		double sinc = j == 0 ? 2*fc : sin(2*M_PI*fc*j)/(M_PI*j);
+		w[j + h] = sinc*(0.54 + 0.46*cos(M_PI*j/h)); // hamming window
+		w_sum += w[j + h];
+	}
+
+	if (angle_col >= 0) {
+		for (int t = 1; t < N; t++)
+			x(t, angle_col) = x(t - 1, angle_col) + remainder(x(t, angle_col) - x(t - 1, angle_col), 2*M_PI);
+	}
+
+	T y((N - 1)/factor + 1, x.cols());
+	y.setZero();
+	for (int t = 0; t < y.rows(); t++) {
+		for (int j = -h; j <= h; j++) {
+			int s = min(max(t*factor + j, 0), N - 1);
+			y.row(t) += w[j + h]/w_sum*x.row(s);
+		}
+	}
+
+	x.swap(y);
+}
+
 
 int main(int argc, char const *argv[])
 {
@@ -36,6 +72,51 @@ int main(int argc, char const *argv[])
 	// typedef Innertia_drone_model M;
 	typedef Simple_drone_model M;
 
+	bool stochastic = false;
+	if (!config["stochastic"].is_null()) {
+		stochastic = config["stochastic"];
+	}
+
+	int decimation = 1;
+	if (!stochastic && !config["decimation"].is_null()) {
+		decimation = config["decimation"];
+	}
+
+	bool coarse_to_fine = false;
+	if (!config["coarse_to_fine"].is_null()) {
+		coarse_to_fine = config["coarse_to_fine"];
+	}
+
+	// identification at dt*decimation, delays are rounded to the new step
+	json coarse_config = config;
+	coarse_config["dt"] = (double)config["dt"]*decimation;
+	coarse_config["u_delay"] = (int)lround((double)config["u_delay"]/decimation);
+	coarse_config["u_delay_max"] = (int)lround((double)config["u_delay_max"]/decimation);
+
+	if (decimation > 1 && !coarse_to_fine) {
+		config = coarse_config; // only the decimated data is identified
+	}
+
+	bool use_coarse = decimation > 1 && coarse_to_fine;
+	if (use_coarse && (!config["bootstrap_samples"].is_null() || !config["cv_folds"].is_null() ||
+		(!config["delay_search"].is_null() && (bool)config["delay_search"]) ||
+		(!config["admm_shards"].is_null() && (int)config["admm_shards"] > 0) ||
+		(!config["multistart_starts"].is_null() && (int)config["multistart_starts"] > 1))) {
+		// these modes start from the prior, the coarse solution would be unused
+		cerr << "coarse_to_fine can not be used with bootstrap, cv, delay search, admm or multistart" << endl;
+		return 1;
+	}
+	if (!config["checkpoint_file"].is_null() && (
+		(!config["delay_search"].is_null() && (bool)config["delay_search"]) ||
+		(!config["admm_shards"].is_null() && (int)config["admm_shards"] > 0) ||
+		(!config["multistart_starts"].is_null() && (int)config["multistart_starts"] > 1))) {
+		// these modes solve in other instances that start from the prior
+		cerr << "checkpoint_file can not be used with delay search, admm or multistart" << endl;
+		return 1;
+	}
+	Model_ident<M> coarse_ident;
+	coarse_ident.set_config(coarse_config);
+
 	Model_ident<M> model_ident;
 	model_ident.set_config(config);
 	
@@ -54,6 +135,18 @@ int main(int argc, char const *argv[])
 	string log_dir(config["log_dir"]);
 	vector<string> log_files = list_files_in_dir(log_dir);
 
+	if (stochastic) {
+		// trajectories are not loaded, random windows are read from the files every iteration
+		vector<string> files;
+		for (int i = 0; i < min((int)log_files.size(), max_models); i++)
+			files.push_back(log_dir + "/" + log_files[i]);
+
+		model_ident.solve_stochastic(files, u_delay);
+
+		cout << "par est " << model_ident.param_est.transpose() << endl;
+		return 0;
+	}
+
 	cout << "using files:" << endl;
 
 
@@ -71,10 +164,91 @@ int main(int argc, char const *argv[])
 
 		cout << buffer << " : " << pos.rows() << " timesteps" << endl;
 
-		model_ident.add_trajectory(pos, input);
+		if (use_coarse) {
+			model_ident.add_trajectory(pos, input);
+		}
+
+		if (decimation > 1) {
+			decimate(pos, decimation, M::a_idx);
+			decimate(input, decimation);
+		}
+
+		if (use_coarse) {
+			coarse_ident.add_trajectory(pos, input);
+		}
+		else {
+			model_ident.add_trajectory(pos, input);
+		}
+	}
+
+	if (model_ident.smooth_init) {
+		// initial values from the smoother instead of raw observations
+		model_ident.smooth_trajectories();
+
+		if (use_coarse)
+			coarse_ident.smooth_trajectories();
 	}
 
+	if (use_coarse) {
+		// the coarse solution warm-starts the parameters of the full rate identification
+		ceres::Solver::Summary coarse_summary;
+		coarse_ident.build_problem((int)coarse_config["u_delay"]);
+		coarse_ident.solve(&coarse_summary);
+
+		cout << coarse_summary.BriefReport() << endl;
+		cout << "coarse par est " << coarse_ident.param_est.transpose() << endl;
+	}
 	
+	if (!config["bootstrap_samples"].is_null()) {
+		// bootstrap mode, write parameter estimates of resampled trajectory sets
+		int n_samples = config["bootstrap_samples"];
+		Model_ident<M>::p_mat par_samples = model_ident.bootstrap(n_samples, u_delay);
+
+		string par_file(config["bootstrap_file"]);
+		ofstream par_log(par_file, ios::app);
+		par_log << fixed << setprecision(4);
+		for (int b = 0; b < par_samples.rows(); b++) {
+			for (int i = 0; i < M::p_dim; i++) {
+				par_log << par_samples(b, i) << (i < M::p_dim - 1 ? ',' : '\n');
+			}
+		}
+		par_log.close();
+
+		cout << "bootstrap par mean " << par_samples.colwise().mean() << endl;
+		cout << "written " << n_samples << " samples to " << par_file << endl;
+		return 0;
+	}
+
+	if (!config["cv_folds"].is_null()) {
+		// cross-validation mode, write prediction errors of the held-out trajectories per fold
+		int n_folds = config["cv_folds"];
+		int horizon = 25;
+		if (!config["cv_horizon"].is_null()) {
+			horizon = config["cv_horizon"];
+		}
+
+		Eigen::MatrixXd metrics = model_ident.cross_validate(n_folds, u_delay, horizon);
+
+		string cv_file(config["cv_file"]);
+		ofstream cv_log(cv_file);
+		cv_log << "fold,cost,open_rmse,step_rmse";
+		for (int i = 0; i < M::p_dim; i++)
+			cv_log << ",p" << i;
+		cv_log << '\n' << fixed << setprecision(4);
+		for (int f = 0; f < metrics.rows(); f++) {
+			cv_log << f;
+			for (int i = 0; i < metrics.cols(); i++)
+				cv_log << ',' << metrics(f, i);
+			cv_log << '\n';
+		}
+		cv_log.close();
+
+		cout << "cv open-loop rmse " << metrics.col(1).mean() << ", " << horizon 
+			<< "-step rmse " << metrics.col(2).mean() << endl;
+		cout << "written " << n_folds << " folds to " << cv_file << endl;
+		return 0;
+	}
+
 	// options.minimizer_progress_to_stdout = true;
 
 	ceres::Solver::Summary summary;
@@ -86,43 +260,76 @@ int main(int argc, char const *argv[])
 	
 	int model_delay = u_delay;
 
-	M::s_vec stat;
-	double best_stat = -INFINITY;
-	int best_delay = -1;
-	model_ident.build_problem(model_delay);
-	model_ident.solve(&summary);
+	bool delay_search = false;
+	if (!config["delay_search"].is_null()) {
+		delay_search = config["delay_search"];
+	}
 
-	cout << summary.BriefReport() << endl;
+	if (delay_search && !model_ident.u_delay_shift) {
+		// without the shift the delays differ only in the zeroed first inputs,
+		// the correlation score pairs states with shifted inputs
+		cerr << "delay_search requires u_delay_shift" << endl;
+		return 1;
+	}
 
-	// while (true) {
-	// 	cout << "model delay " << model_delay << endl;
-		
-	// 	cout << summary.BriefReport() << endl;
+	if (delay_search && u_delay_max > u_delay) {
+		// solve every delay in u_delay..u_delay_max in parallel and keep the best
+		Eigen::VectorXd delay_scores;
+		model_delay = model_ident.delay_search(u_delay, u_delay_max, delay_scores);
+	}
+	else if (model_ident.admm_shards > 0) {
+		// shards of trajectories solved in parallel, coupled by consensus on parameters
+		model_ident.solve_admm(model_delay);
+	}
+	else if (model_ident.multistart_starts > 1) {
+		// random initial parameters solved in parallel, the best few to convergence
+		model_ident.solve_multistart(model_delay);
+	}
+	else {
+		model_ident.build_problem(model_delay);
 
-	// 	best_stat = -INFINITY;
-	// 	best_delay = -1;
+		if (use_coarse) {
+			model_ident.param_est = coarse_ident.param_est;
+		}
 
-	// 	for (int d = 0; d < u_delay_max; d++) {
-	// 		stat = model_ident.calculate_state_equation_corr(model_ident.param_est, dt, d);
-	// 		cout << "delay: " << d << ", state eq corr: " << stat.transpose() << endl;
-			
+		if (!config["checkpoint_file"].is_null()) {
+			// logs identified in the last run start from their estimates
+			int matched = model_ident.load_checkpoint(config["checkpoint_file"], log_files);
+			cout << "warm start of " << matched << " trajectories from checkpoint" << endl;
+		}
 
-	// 		if (stat.mean() > best_stat) {
-	// 			best_stat = stat.mean();
-	// 			best_delay = d;
-	// 		}
-	// 	}
+		model_ident.solve(&summary);
 
-	// 	if (best_delay == model_delay) {
-	// 		break;
-	// 	}
+		cout << summary.BriefReport() << endl;
 
-	// 	model_delay = best_delay;
-	// }
+		if (!config["checkpoint_file"].is_null()) {
+			model_ident.save_checkpoint(config["checkpoint_file"], log_files);
+		}
+	}
 	
 
 	cout << "delay est" << model_delay << endl;
 	cout << "par est " << model_ident.param_est.transpose() << endl;
+
+	bool calc_cov = false;
+	if (!config["calc_cov"].is_null()) {
+		calc_cov = config["calc_cov"];
+	}
+
+	if (calc_cov && model_ident.problem == nullptr) {
+		// delay search, admm and multistart solve in other instances,
+		// the problem is built at the final estimate, build_problem resets the parameters
+		Model_ident<M>::p_vec p_final = model_ident.param_est;
+		model_ident.build_problem(model_delay);
+		model_ident.param_est = p_final;
+	}
+
+	Model_ident<M>::p_cov_mat par_cov;
+	if (calc_cov && model_ident.param_covariance(par_cov)) {
+		cout << "par sd " << par_cov.diagonal().cwiseSqrt().transpose() << endl;
+		cout << "par cov" << endl << par_cov << endl;
+	}
+
 	cout << "state corr" << model_ident.calculate_state_equation_corr(model_ident.param_est, dt, model_delay).transpose() << endl;
 
 	if (!config["clear_log_est_dir"].is_null()) {
@@ -142,8 +349,8 @@ int main(int argc, char const *argv[])
 		for (int t = 0; t < model_ident.state_est[i]->rows(); t++) {
 			M::output_eq(o.data(), model_ident.state_est[i]->row(t).data());
 			logger << "pos" << t << o << '\n';
-			if (model_ident.use_param_shift && t < model_ident.param_shift_est[i]->rows()) {
-				p = model_ident.param_shift_est[i]->row(t);
+			if (model_ident.use_param_shift && t < model_ident.state_est[i]->rows() - 1) {
+				p = model_ident.param_shift_est[i]->row(t/model_ident.param_shift_segment);
 				logger << "param" << t << p << '\n';
 			}
 		}
@@ -20,6 +20,14 @@ class Parser
 {
 public:
 	static map<string, vector<vector<double>>> parse_log(string file_name, vector<string> tags, vector<bool> has_id);
+
+	// for reading parts of logs with ids repeatedly, offsets of the first line of every
+	// stride-th id, rows is the number of ids of tag, only the tag and id of a line are parsed
+	static vector<streampos> index_log(string file_name, string tag, int stride, int &rows);
+
+	// lines of tags with ids id_min..id_max, read from start, row 0 is id_min
+	static map<string, vector<vector<double>>> parse_log_range(string file_name, vector<string> tags, 
+		streampos start, int id_min, int id_max);
 	
 	template<int S>
 	static void fill_matrix(Eigen::Matrix<double, -1, S, Eigen::RowMajor> &mat, vector<vector<double>> &data);
@@ -82,6 +90,70 @@ map<string, vector<vector<double>>> Parser::parse_log(string file_name, vector<s
 	return result;
 }
 
+vector<streampos> Parser::index_log(string file_name, string tag, int stride, int &rows)
+{
+	ifstream file(file_name);
+	assert(file.is_open());
+
+	vector<streampos> offsets;
+	rows = 0;
+
+	string line("");
+	streampos pos = file.tellg();
+	while(getline(file, line)) {
+		size_t c0 = line.find(',');
+		size_t c1 = line.find(',', c0 + 1);
+		if (c0 != string::npos && c1 != string::npos) {
+			int id = stoi(line.substr(c0 + 1, c1 - c0 - 1));
+			if (id % stride == 0 && offsets.size() == id/stride)
+				offsets.push_back(pos);
+			if (line.compare(0, c0, tag) == 0)
+				rows = max(rows, id + 1);
+		}
+		pos = file.tellg();
+	}
+
+	return offsets;
+}
+
+map<string, vector<vector<double>>> Parser::parse_log_range(string file_name, vector<string> tags, 
+	streampos start, int id_min, int id_max)
+{
+	ifstream file(file_name);
+	assert(file.is_open());
+	file.seekg(start);
+
+	map<string, vector<vector<double>>> result;
+	for (auto &tag : tags)
+		result[tag].resize(id_max - id_min + 1);
+
+	string line("");
+	vector<string> line_split;
+
+	while(getline(file, line)) {
+		line_split = split_string(line, ',');
+		if (line_split.size() < 2)
+			continue;
+
+		int id = stoi(line_split[1]);
+		if (id > id_max)
+			break; // ids are increasing
+		if (id < id_min)
+			continue;
+
+		for (int i = 0; i < tags.size(); i++) {
+			if (line_split[0].compare(tags[i]) == 0) {
+				for (int j = 2; j < line_split.size(); j++) {
+					result[tags[i]][id - id_min].push_back(stod(line_split[j]));
+				}
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
 template<int S>
 void Parser::fill_matrix(Eigen::Matrix<double, -1, S, Eigen::RowMajor> &mat, vector<vector<double>> &data)
 {
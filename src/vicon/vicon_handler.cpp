@@ -12,6 +12,10 @@ void vicon_handler_func(Vicon_handler *hndl)
 	{
 		hndl->object_mtx.lock();
 		hndl->object = obj;
+		hndl->new_objects.push_back(obj);
+		if (hndl->new_objects.size() > hndl->max_new_objects) {
+			hndl->new_objects.erase(hndl->new_objects.begin());
+		}
 		hndl->object_mtx.unlock();
 	}
 
@@ -29,6 +33,16 @@ CViconObject Vicon_handler::get_val()
 	return obj;
 }
 
+vector<CViconObject> Vicon_handler::get_new_vals()
+{
+	vector<CViconObject> objs;
+
+	this->object_mtx.lock();
+	objs.swap(this->new_objects);
+	this->object_mtx.unlock();
+
+	return objs;
+}
 
 Vicon_handler::Vicon_handler(string ip)
 {
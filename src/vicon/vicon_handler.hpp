@@ -5,6 +5,7 @@
 #include <mutex>
 #include <atomic>
 #include <iostream>
+#include <vector>
 
 #include "vicon_client.h"
 
@@ -23,6 +24,8 @@ private:
 
 	mutex object_mtx;
 	CViconObject object;
+	vector<CViconObject> new_objects; // frames received since last get_new_vals
+	size_t max_new_objects = 100;
 
 	friend void vicon_handler_func(Vicon_handler *hndl);
 
@@ -31,6 +34,7 @@ public:
 	~Vicon_handler();
 
 	CViconObject get_val();
+	vector<CViconObject> get_new_vals();
 
 	CViconObject operator()() { return this->get_val(); }
 };